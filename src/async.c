@@ -0,0 +1,521 @@
+#include <mongolite.h>
+#include <mongoc/mongoc-collection-private.h>
+#include <mongoc/mongoc-thread-private.h>
+
+/* Asynchronous operations. Each task runs on its own thread with a client popped from
+ * the pool of a pooled client, or from a private pool that a single client creates
+ * for its first task and keeps for later ones. The thread parses the input, runs the
+ * operation and appends all result documents to a single buffer of raw bson. The R thread only converts the buffer to R objects
+ * once the task is done. Threads are detached and a task is reference counted by its
+ * R handle and its worker, so that finalizers never wait for a running query: the
+ * last owner frees the task, and a shared pool is kept alive until its last task
+ * releases it.
+ *
+ * A batch instead starts at most 'concurrency' workers which take tasks from a
+ * shared queue until it is empty. Tasks of a non-pooled client do not get a pool of
+ * their own: the batch creates one pool per client when a worker first needs it,
+ * sized to the number of workers, and destroys it after the last worker is done. */
+
+enum {TASK_FIND, TASK_AGGREGATE, TASK_INSERT, TASK_COUNT};
+
+typedef struct {
+  mongoc_client_t *client;
+  pool_spec *spec;
+  mongoc_client_pool_t *pool;
+  int size;
+} batch_source;
+
+typedef struct async_task {
+  int refs;
+  int type;
+  bool done;
+  bool started;
+  bool ordered;
+  bool estimate;
+  batch_source *source;
+  char *db;
+  char *collection;
+  bson_t *filter;
+  bson_t *opts;
+  mongoc_read_prefs_t *prefs;
+  char **json;
+  int n_json;
+  mongoc_client_pool_t *pool;
+  uint8_t *buf;
+  size_t len;
+  size_t cap;
+  int count;
+  int64_t n;
+  bson_t reply;
+  bool failed;
+  bson_error_t err;
+  int64_t start_us;
+  int64_t end_us;
+} async_task;
+
+typedef struct {
+  async_task **tasks;
+  int n;
+  int next;
+  batch_source *sources;
+  int n_sources;
+  int refs;
+} async_batch;
+
+static bson_mutex_t async_lock;
+static mongoc_cond_t async_cond;
+static int n_workers = 0;
+
+static void task_release(async_task *task);
+
+static void thread_detach(bson_thread_t thread){
+#ifdef _WIN32
+  CloseHandle(thread);
+#else
+  pthread_detach(thread);
+#endif
+}
+
+static void append_doc(async_task *task, const bson_t *doc){
+  if(task->len + doc->len > task->cap){
+    task->cap = BSON_MAX(2 * task->cap, task->len + doc->len + 4096);
+    task->buf = bson_realloc(task->buf, task->cap);
+  }
+  memcpy(task->buf + task->len, bson_get_data(doc), doc->len);
+  task->len += doc->len;
+  task->count++;
+}
+
+static void drain_cursor(async_task *task, mongoc_cursor_t *cursor){
+  const bson_t *doc;
+  while(mongoc_cursor_next(cursor, &doc))
+    append_doc(task, doc);
+  if(mongoc_cursor_error(cursor, &task->err))
+    task->failed = true;
+  mongoc_cursor_destroy(cursor);
+}
+
+static void run_insert(async_task *task, mongoc_collection_t *col){
+  bson_t *opts = BCON_NEW("ordered", BCON_BOOL(task->ordered));
+  mongoc_bulk_operation_t *bulk = mongoc_collection_create_bulk_operation_with_opts(col, opts);
+  bson_destroy(opts);
+  for(int i = 0; i < task->n_json; i++){
+    bson_t *doc = bson_new_from_json((uint8_t*) task->json[i], -1, &task->err);
+    if(!doc){
+      task->failed = true;
+      mongoc_bulk_operation_destroy(bulk);
+      return;
+    }
+    mongoc_bulk_operation_insert(bulk, doc);
+    bson_destroy(doc);
+  }
+  if(!mongoc_bulk_operation_execute(bulk, &task->reply, &task->err))
+    task->failed = true;
+  mongoc_bulk_operation_destroy(bulk);
+}
+
+static void run_count(async_task *task, mongoc_collection_t *col){
+  task->n = task->estimate ?
+    mongoc_collection_estimated_document_count(col, task->opts, task->prefs, NULL, &task->err) :
+    mongoc_collection_count_documents(col, task->filter, task->opts, task->prefs, NULL, &task->err);
+  if(task->n < 0)
+    task->failed = true;
+}
+
+static void task_run(async_task *task, mongoc_client_pool_t *pool){
+  if(!pool){
+    task->failed = true;
+    bson_set_error(&task->err, MONGOC_ERROR_CLIENT, MONGOC_ERROR_CLIENT_NOT_READY, "Failed to create client pool");
+    return;
+  }
+  bool shared = pool == task->pool;
+  mongoc_client_t *client = shared ? pool_pop(pool) : mongoc_client_pool_pop(pool);
+  mongoc_collection_t *col = mongoc_client_get_collection(client, task->db, task->collection);
+  switch(task->type){
+  case TASK_FIND:
+    drain_cursor(task, mongoc_collection_find_with_opts(col, task->filter, task->opts, task->prefs));
+    break;
+  case TASK_AGGREGATE:
+    drain_cursor(task, mongoc_collection_aggregate(col, MONGOC_QUERY_NONE, task->filter, task->opts, task->prefs));
+    break;
+  case TASK_INSERT:
+    run_insert(task, col);
+    break;
+  case TASK_COUNT:
+    run_count(task, col);
+    break;
+  }
+  mongoc_collection_destroy(col);
+  if(shared)
+    pool_push(pool, client);
+  else
+    mongoc_client_pool_push(pool, client);
+}
+
+static void task_finish(async_task *task){
+  bson_mutex_lock(&async_lock);
+  task->end_us = bson_get_monotonic_time();
+  task->done = true;
+  mongoc_cond_broadcast(&async_cond);
+  bson_mutex_unlock(&async_lock);
+  task_release(task);
+}
+
+static BSON_THREAD_FUN(async_worker, arg){
+  async_task *task = arg;
+  task_run(task, task->pool);
+  task_finish(task);
+  bson_mutex_lock(&async_lock);
+  n_workers--;
+  mongoc_cond_broadcast(&async_cond);
+  bson_mutex_unlock(&async_lock);
+  BSON_THREAD_RETURN;
+}
+
+/* Called with async_lock held. Creating a pool does not connect yet. */
+static mongoc_client_pool_t * source_pool(batch_source *source){
+  if(!source->pool && source->spec){
+    source->pool = pool_spec_create(source->spec, source->size);
+    pool_spec_free(source->spec);
+    source->spec = NULL;
+  }
+  return source->pool;
+}
+
+/* Runs after the last worker is done, so all clients have been pushed back */
+static void batch_free(async_batch *batch){
+  for(int i = 0; i < batch->n_sources; i++){
+    if(batch->sources[i].pool)
+      mongoc_client_pool_destroy(batch->sources[i].pool);
+    pool_spec_free(batch->sources[i].spec);
+  }
+  bson_free(batch->sources);
+  bson_free(batch->tasks);
+  bson_free(batch);
+}
+
+static BSON_THREAD_FUN(batch_worker, arg){
+  async_batch *batch = arg;
+  for(;;){
+    bson_mutex_lock(&async_lock);
+    if(batch->next == batch->n){
+      bson_mutex_unlock(&async_lock);
+      break;
+    }
+    async_task *task = batch->tasks[batch->next++];
+    task->start_us = bson_get_monotonic_time();
+    mongoc_client_pool_t *pool = task->source ? source_pool(task->source) : task->pool;
+    bson_mutex_unlock(&async_lock);
+    task_run(task, pool);
+    task_finish(task);
+  }
+  bson_mutex_lock(&async_lock);
+  bool last = --batch->refs == 0;
+  n_workers--;
+  mongoc_cond_broadcast(&async_cond);
+  bson_mutex_unlock(&async_lock);
+  if(last)
+    batch_free(batch);
+  BSON_THREAD_RETURN;
+}
+
+/* May run on the worker thread if the R handle was collected first */
+static void task_free(async_task *task){
+  if(task->pool)
+    pool_release(task->pool);
+  for(int i = 0; i < task->n_json; i++)
+    bson_free(task->json[i]);
+  bson_free(task->json);
+  bson_destroy(task->filter);
+  bson_destroy(task->opts);
+  mongoc_read_prefs_destroy(task->prefs);
+  if(task->type == TASK_INSERT)
+    bson_destroy(&task->reply);
+  bson_free(task->buf);
+  bson_free(task->db);
+  bson_free(task->collection);
+  bson_free(task);
+}
+
+static void task_release(async_task *task){
+  bson_mutex_lock(&async_lock);
+  bool last = --task->refs == 0;
+  bson_mutex_unlock(&async_lock);
+  if(last)
+    task_free(task);
+}
+
+/* Only drops the reference of the R handle, a running worker finishes on its own */
+static void fin_task(SEXP ptr){
+  async_task *task = R_ExternalPtrAddr(ptr);
+  if(!task) return;
+  R_SetExternalPtrProtected(ptr, R_NilValue);
+  R_ClearExternalPtr(ptr);
+  task_release(task);
+}
+
+static async_task *r2task(SEXP ptr){
+  log_flush();
+  async_task *task = R_ExternalPtrAddr(ptr);
+  if(!task)
+    stop("async task has been destroyed.");
+  return task;
+}
+
+void async_init(void){
+  bson_mutex_init(&async_lock);
+  mongoc_cond_init(&async_cond);
+}
+
+/* Waits for detached workers before the library is unloaded */
+void async_cleanup(void){
+  bson_mutex_lock(&async_lock);
+  while(n_workers > 0)
+    mongoc_cond_wait(&async_cond, &async_lock);
+  bson_mutex_unlock(&async_lock);
+  mongoc_cond_destroy(&async_cond);
+  bson_mutex_destroy(&async_lock);
+}
+
+/* The task keeps the collection, and hence the client, alive until it is destroyed.
+ * Deferred tasks of a non-pooled client get their pool from the batch. */
+static SEXP task_prepare(async_task *task, SEXP ptr_col, bool defer){
+  mongoc_collection_t *col = r2col(ptr_col);
+  SEXP ptr_client = R_ExternalPtrProtected(ptr_col);
+  task->db = bson_strdup(col->db);
+  task->collection = bson_strdup(mongoc_collection_get_name(col));
+  task->refs = 1;
+  if((task->pool = defer ? client_get_pool(ptr_client) : client_async_pool(ptr_client)))
+    pool_retain(task->pool);
+  SEXP ptr = PROTECT(R_MakeExternalPtr(task, R_NilValue, ptr_col));
+  R_RegisterCFinalizerEx(ptr, fin_task, 1);
+  Rf_setAttrib(ptr, R_ClassSymbol, Rf_mkString("mongo_async_task"));
+  if(!task->pool && !defer){
+    task->failed = task->done = true;
+    bson_set_error(&task->err, MONGOC_ERROR_CLIENT, MONGOC_ERROR_CLIENT_NOT_READY, "Failed to create client pool");
+  }
+  UNPROTECT(1);
+  return ptr;
+}
+
+static void task_launch(async_task *task){
+  if(task->done || task->started)
+    return;
+  task->start_us = bson_get_monotonic_time();
+  bson_thread_t thread;
+  bson_mutex_lock(&async_lock);
+  task->refs++;
+  n_workers++;
+  if(mcommon_thread_create(&thread, async_worker, task) == 0){
+    task->started = true;
+    thread_detach(thread);
+  } else {
+    task->refs--;
+    n_workers--;
+    task->failed = task->done = true;
+    bson_set_error(&task->err, MONGOC_ERROR_CLIENT, MONGOC_ERROR_CLIENT_NOT_READY, "Failed to start worker thread");
+  }
+  bson_mutex_unlock(&async_lock);
+}
+
+/* Deferred tasks are started later by R_mongo_batch_start() */
+static SEXP task_start(async_task *task, SEXP ptr_col, SEXP defer){
+  bool deferred = Rf_asLogical(defer);
+  SEXP ptr = PROTECT(task_prepare(task, ptr_col, deferred));
+  if(!deferred)
+    task_launch(task);
+  UNPROTECT(1);
+  return ptr;
+}
+
+SEXP R_mongo_async_find(SEXP ptr_col, SEXP ptr_query, SEXP ptr_opts, SEXP prefs, SEXP defer){
+  mongoc_read_prefs_t *rp = r2readprefs(prefs);
+  async_task *task = bson_malloc0(sizeof(async_task));
+  task->type = TASK_FIND;
+  task->prefs = rp;
+  task->filter = bson_copy(r2bson(ptr_query));
+  task->opts = bson_copy(r2bson(ptr_opts));
+  return task_start(task, ptr_col, defer);
+}
+
+SEXP R_mongo_async_aggregate(SEXP ptr_col, SEXP ptr_pipeline, SEXP ptr_options, SEXP prefs, SEXP defer){
+  mongoc_read_prefs_t *rp = r2readprefs(prefs);
+  async_task *task = bson_malloc0(sizeof(async_task));
+  task->type = TASK_AGGREGATE;
+  task->prefs = rp;
+  task->filter = bson_copy(r2bson(ptr_pipeline));
+  task->opts = bson_copy(r2bson(ptr_options));
+  return task_start(task, ptr_col, defer);
+}
+
+/* Json is copied here, and parsed into bson by the worker */
+SEXP R_mongo_async_insert(SEXP ptr_col, SEXP json_vec, SEXP stop_on_error, SEXP defer){
+  if(!Rf_isString(json_vec) || !Rf_length(json_vec))
+    stop("json_vec must be character string of at least length 1");
+  int n = Rf_length(json_vec);
+  async_task *task = bson_malloc0(sizeof(async_task));
+  task->type = TASK_INSERT;
+  task->ordered = Rf_asLogical(stop_on_error);
+  bson_init(&task->reply);
+  task->json = bson_malloc0(n * sizeof(char*));
+  task->n_json = n;
+  for(int i = 0; i < n; i++)
+    task->json[i] = bson_strdup(Rf_translateCharUTF8(STRING_ELT(json_vec, i)));
+  return task_start(task, ptr_col, defer);
+}
+
+SEXP R_mongo_async_count(SEXP ptr_col, SEXP ptr_filter, SEXP ptr_opts, SEXP estimate, SEXP prefs, SEXP defer){
+  mongoc_read_prefs_t *rp = r2readprefs(prefs);
+  async_task *task = bson_malloc0(sizeof(async_task));
+  task->type = TASK_COUNT;
+  task->prefs = rp;
+  task->estimate = Rf_asLogical(estimate);
+  task->filter = bson_copy(r2bson(ptr_filter));
+  task->opts = bson_copy(r2bson(ptr_opts));
+  return task_start(task, ptr_col, defer);
+}
+
+static batch_source * batch_add_source(async_batch *batch, SEXP ptr_client){
+  mongoc_client_t *client = r2client(ptr_client);
+  for(int i = 0; i < batch->n_sources; i++){
+    if(batch->sources[i].client == client)
+      return &batch->sources[i];
+  }
+  batch_source *source = &batch->sources[batch->n_sources++];
+  source->client = client;
+  source->spec = pool_spec_new(client);
+  return source;
+}
+
+/* Queues deferred tasks and starts at most 'concurrency' workers to run them */
+SEXP R_mongo_batch_start(SEXP tasks, SEXP concurrency){
+  int n = Rf_length(tasks);
+  for(int i = 0; i < n; i++){
+    SEXP ptr = VECTOR_ELT(tasks, i);
+    async_task *task = r2task(ptr);
+    if(task->started || task->done)
+      stop("Task has already been started");
+    r2client(R_ExternalPtrProtected(R_ExternalPtrProtected(ptr)));
+  }
+  if(!n)
+    return tasks;
+  int limit = BSON_MIN(n, BSON_MAX(1, Rf_asInteger(concurrency)));
+  async_batch *batch = bson_malloc0(sizeof(async_batch));
+  batch->tasks = bson_malloc0(n * sizeof(async_task*));
+  batch->sources = bson_malloc0(n * sizeof(batch_source));
+  for(int i = 0; i < n; i++){
+    SEXP ptr = VECTOR_ELT(tasks, i);
+    async_task *task = r2task(ptr);
+    if(!task->pool){
+      task->source = batch_add_source(batch, R_ExternalPtrProtected(R_ExternalPtrProtected(ptr)));
+      task->source->size = BSON_MIN(task->source->size + 1, limit);
+    }
+    task->refs++;
+    task->started = true;
+    batch->tasks[batch->n++] = task;
+  }
+  bson_mutex_lock(&async_lock);
+  for(int i = 0; i < limit; i++){
+    bson_thread_t thread;
+    batch->refs++;
+    n_workers++;
+    if(mcommon_thread_create(&thread, batch_worker, batch) == 0){
+      thread_detach(thread);
+    } else {
+      batch->refs--;
+      n_workers--;
+    }
+  }
+  bool failed = batch->refs == 0;
+  bson_mutex_unlock(&async_lock);
+  if(failed){
+    for(int i = 0; i < n; i++){
+      async_task *task = batch->tasks[i];
+      task->failed = true;
+      bson_set_error(&task->err, MONGOC_ERROR_CLIENT, MONGOC_ERROR_CLIENT_NOT_READY, "Failed to start worker thread");
+      task_finish(task);
+    }
+    batch_free(batch);
+  }
+  return tasks;
+}
+
+SEXP R_mongo_async_ready(SEXP ptr){
+  async_task *task = r2task(ptr);
+  bson_mutex_lock(&async_lock);
+  bool done = task->done;
+  bson_mutex_unlock(&async_lock);
+  return Rf_ScalarLogical(done);
+}
+
+/* Waits in short slices so that the user can interrupt. Timeout in ms, or NA. */
+SEXP R_mongo_async_wait(SEXP ptr, SEXP timeout){
+  async_task *task = r2task(ptr);
+  if(!task->started && !task->done)
+    stop("Task has not been started");
+  double limit = Rf_asReal(timeout);
+  int64_t deadline = !R_FINITE(limit) ? INT64_MAX : bson_get_monotonic_time() + (int64_t) (limit * 1000);
+  for(;;){
+    bson_mutex_lock(&async_lock);
+    int64_t remaining = deadline - bson_get_monotonic_time();
+    if(!task->done && remaining > 0)
+      mongoc_cond_timedwait(&async_cond, &async_lock, BSON_MAX(1, BSON_MIN(remaining / 1000, 100)));
+    bool done = task->done;
+    bson_mutex_unlock(&async_lock);
+    if(done || bson_get_monotonic_time() >= deadline)
+      return Rf_ScalarLogical(done);
+    R_CheckUserInterrupt();
+  }
+}
+
+/* Returns a list of documents for reads, or the bulk reply for inserts */
+SEXP R_mongo_async_result(SEXP ptr){
+  async_task *task = r2task(ptr);
+  R_mongo_async_wait(ptr, Rf_ScalarReal(NA_REAL));
+  if(task->type == TASK_COUNT){
+    if(task->failed)
+      stop(task->err.message);
+    return Rf_ScalarReal((double) task->n);
+  }
+  if(task->type == TASK_INSERT){
+    if(task->failed){
+      if(task->ordered)
+        stop(task->err.message);
+      Rf_warningcall(R_NilValue, "Not all inserts were successful: %s\n", task->err.message);
+    }
+    return bson2list(&task->reply);
+  }
+  if(task->failed)
+    stop(task->err.message);
+  SEXP out = PROTECT(Rf_allocVector(VECSXP, task->count));
+  size_t offset = 0;
+  for(int i = 0; i < task->count; i++){
+    bson_t doc;
+    uint32_t len;
+    memcpy(&len, task->buf + offset, sizeof len);
+    len = BSON_UINT32_FROM_LE(len);
+    if(!bson_init_static(&doc, task->buf + offset, len))
+      stop("Invalid bson in async result");
+    SET_VECTOR_ELT(out, i, bson2list(&doc));
+    offset += len;
+  }
+  UNPROTECT(1);
+  return out;
+}
+
+SEXP R_mongo_async_info(SEXP ptr){
+  async_task *task = r2task(ptr);
+  const char *types[] = {"find", "aggregate", "insert", "count"};
+  bson_mutex_lock(&async_lock);
+  bool done = task->done;
+  int64_t end = done ? task->end_us : bson_get_monotonic_time();
+  bson_mutex_unlock(&async_lock);
+  SEXP out = PROTECT(Rf_allocVector(VECSXP, 5));
+  SET_VECTOR_ELT(out, 0, Rf_mkString(types[task->type]));
+  SET_VECTOR_ELT(out, 1, Rf_ScalarLogical(done));
+  SET_VECTOR_ELT(out, 2, Rf_ScalarReal(task->start_us ? (end - task->start_us) / 1000.0 : 0));
+  SET_VECTOR_ELT(out, 3, Rf_ScalarReal(done && task->type < TASK_INSERT ? task->count : NA_REAL));
+  SET_VECTOR_ELT(out, 4, Rf_ScalarReal(done ? task->len : NA_REAL));
+  UNPROTECT(1);
+  return out;
+}
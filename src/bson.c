@@ -5,6 +5,7 @@ static int bigint_as_char = 0;
 static int date_as_char = 0;
 
 SEXP ConvertArray(bson_iter_t* iter, bson_iter_t* counter);
+SEXP ConvertAtomic(bson_iter_t* iter, bson_iter_t* counter);
 SEXP ConvertObject(bson_iter_t* iter, bson_iter_t* counter);
 SEXP ConvertValue(bson_iter_t* iter);
 SEXP ConvertBinary(bson_iter_t* iter);
@@ -195,6 +196,114 @@ SEXP ConvertArray(bson_iter_t* iter, bson_iter_t* counter){
   return ret;
 }
 
+/* R type of a value in an atomic vector. Nulls are NILSXP because they fit in
+ * any type, values that only fit in a list are VECSXP. */
+SEXPTYPE atomic_type(bson_iter_t* iter){
+  switch(bson_iter_type(iter)){
+  case BSON_TYPE_NULL:
+    return NILSXP;
+  case BSON_TYPE_BOOL:
+    return LGLSXP;
+  case BSON_TYPE_INT32:
+    return bson_iter_int32(iter) == NA_INTEGER ? REALSXP : INTSXP;
+  case BSON_TYPE_INT64:
+    return bigint_as_char ? VECSXP : REALSXP;
+  case BSON_TYPE_DOUBLE:
+    return REALSXP;
+  case BSON_TYPE_DATE_TIME:
+    return date_as_char ? VECSXP : REALSXP;
+  case BSON_TYPE_UTF8:
+  case BSON_TYPE_SYMBOL:
+  case BSON_TYPE_OID:
+    return STRSXP;
+  default:
+    return VECSXP;
+  }
+}
+
+/* Type of a vector of values of 'type' after adding a value of 'eltype' */
+SEXPTYPE atomic_common(SEXPTYPE type, SEXPTYPE eltype){
+  if(eltype == NILSXP || (type == REALSXP && eltype == INTSXP))
+    return type;
+  if(type == NILSXP || (type == INTSXP && eltype == REALSXP))
+    return eltype;
+  return type == eltype ? type : VECSXP;
+}
+
+/* Stores a value in element i of an atomic vector of the type from atomic_common() */
+void set_atomic(SEXP ret, R_xlen_t i, bson_iter_t* iter){
+  bool is_null = BSON_ITER_HOLDS_NULL(iter);
+  switch(TYPEOF(ret)){
+  case LGLSXP:
+    LOGICAL(ret)[i] = is_null ? NA_LOGICAL : bson_iter_bool(iter);
+    break;
+  case INTSXP:
+    INTEGER(ret)[i] = is_null ? NA_INTEGER : bson_iter_int32(iter);
+    break;
+  case REALSXP:
+    if(is_null){
+      REAL(ret)[i] = NA_REAL;
+    } else if(BSON_ITER_HOLDS_DATE_TIME(iter)){
+      REAL(ret)[i] = bson_iter_date_time(iter) / 1000.0;
+    } else {
+      REAL(ret)[i] = bson_iter_as_double(iter);
+    }
+    break;
+  case STRSXP:
+    if(is_null){
+      SET_STRING_ELT(ret, i, NA_STRING);
+    } else if(BSON_ITER_HOLDS_OID(iter)){
+      char str[25];
+      bson_oid_to_string(bson_iter_oid(iter), str);
+      SET_STRING_ELT(ret, i, Rf_mkChar(str));
+    } else {
+      uint32_t len;
+      const char *str = BSON_ITER_HOLDS_SYMBOL(iter) ? bson_iter_symbol(iter, &len) : bson_iter_utf8(iter, &len);
+      SET_STRING_ELT(ret, i, Rf_mkCharLenCE(str, len, CE_UTF8));
+    }
+    break;
+  }
+}
+
+void set_posixct(SEXP x){
+  SEXP classes = PROTECT(Rf_allocVector(STRSXP, 2));
+  SET_STRING_ELT(classes, 0, Rf_mkChar("POSIXct"));
+  SET_STRING_ELT(classes, 1, Rf_mkChar("POSIXt"));
+  Rf_setAttrib(x, R_ClassSymbol, classes);
+  UNPROTECT(1);
+}
+
+/* Converts a homogeneous array directly into an atomic vector. Nulls become NA.
+ * Mixed or nested arrays fall back on ConvertArray() which returns a list. */
+SEXP ConvertAtomic(bson_iter_t* iter, bson_iter_t* counter){
+  bson_iter_t start = *counter;
+  int count = 0;
+  int dates = 0;
+  int values = 0;
+  SEXPTYPE type = NILSXP;
+  while(bson_iter_next(counter)){
+    count++;
+    SEXPTYPE eltype = atomic_type(counter);
+    if(eltype == NILSXP)
+      continue;
+    dates += BSON_ITER_HOLDS_DATE_TIME(counter);
+    values++;
+    type = atomic_common(type, eltype);
+    if(type == VECSXP || (dates && dates < values))
+      return ConvertArray(iter, &start);
+  }
+  if(type == NILSXP)
+    return ConvertArray(iter, &start);
+
+  SEXP ret = PROTECT(Rf_allocVector(type, count));
+  for (int i = 0; bson_iter_next(iter); i++)
+    set_atomic(ret, i, iter);
+  if(dates)
+    set_posixct(ret);
+  UNPROTECT(1);
+  return ret;
+}
+
 SEXP ConvertObject(bson_iter_t* iter, bson_iter_t* counter){
   int count = 0;
   while(bson_iter_next(counter)){
@@ -0,0 +1,183 @@
+#include <mongolite.h>
+#include <mongoc/mongoc-collection-private.h>
+
+/* GridFS bucket backend. A bucket is cheap to create (no server round trips),
+ * so one is derived from the legacy gridfs handle for every transfer. Files
+ * written by either API are readable by the other. */
+
+#define MAX_CHUNK_SIZE (16 * 1024 * 1024 - 1024)
+
+static int32_t bucket_chunk_size(SEXP chunk_size){
+  if(!Rf_length(chunk_size))
+    return 0;
+  int32_t size = Rf_asInteger(chunk_size);
+  if(size <= 0 || size > MAX_CHUNK_SIZE)
+    stop("Invalid chunk size");
+  return size;
+}
+
+/* Does not call into R, so it is safe while a FILE* or driver object is held */
+static mongoc_gridfs_bucket_t * new_bucket(mongoc_gridfs_t *fs, mongoc_client_t *client, int32_t chunk_size, bson_error_t *err){
+  mongoc_collection_t *files = mongoc_gridfs_get_files(fs);
+  const char *name = mongoc_collection_get_name(files);
+  char *prefix = bson_strndup(name, strlen(name) - strlen(".files"));
+  bson_t *opts = BCON_NEW("bucketName", BCON_UTF8(prefix));
+  bson_free(prefix);
+  if(chunk_size > 0)
+    BSON_APPEND_INT32(opts, "chunkSizeBytes", chunk_size);
+  mongoc_database_t *db = mongoc_client_get_database(client, files->db);
+  mongoc_gridfs_bucket_t *bucket = mongoc_gridfs_bucket_new(db, opts, mongoc_collection_get_read_prefs(files), err);
+  mongoc_database_destroy(db);
+  bson_destroy(opts);
+  return bucket;
+}
+
+/* If sha256 is given the upload is registered for content deduplication */
+SEXP bucket_upload(SEXP ptr_fs, SEXP name, SEXP path, SEXP content_type, SEXP meta_ptr, SEXP chunk_size, const char *sha256){
+  /* Everything that can raise an R error happens before the file is opened */
+  mongoc_gridfs_t *fs = r2gridfs(ptr_fs);
+  mongoc_client_t *client = r2client(R_ExternalPtrProtected(ptr_fs));
+  int32_t size = bucket_chunk_size(chunk_size);
+  const char *filename = Rf_translateCharUTF8(STRING_ELT(name, 0));
+  const char *fpath = CHAR(STRING_ELT(path, 0));
+  bson_t *meta = Rf_length(meta_ptr) ? r2bson(meta_ptr) : NULL;
+  bson_t opts = BSON_INITIALIZER;
+  if(meta)
+    BSON_APPEND_DOCUMENT(&opts, "metadata", meta);
+  if(Rf_length(content_type) && STRING_ELT(content_type, 0) != NA_STRING)
+    BSON_APPEND_UTF8(&opts, "contentType", CHAR(STRING_ELT(content_type, 0)));
+
+  bson_error_t err;
+  mongoc_gridfs_bucket_t *bucket = new_bucket(fs, client, size, &err);
+  if(!bucket){
+    bson_destroy(&opts);
+    stop(err.message);
+  }
+  FILE *fp = fopen(fpath, "rb");
+  if(!fp){
+    bson_destroy(&opts);
+    mongoc_gridfs_bucket_destroy(bucket);
+    stopf("Failed to open file %s", fpath);
+  }
+  bson_value_t file_id;
+  mongoc_stream_t *stream = mongoc_gridfs_bucket_open_upload_stream(bucket, filename, &opts, &file_id, &err);
+  bson_destroy(&opts);
+  if(!stream){
+    fclose(fp);
+    mongoc_gridfs_bucket_destroy(bucket);
+    stop(err.message);
+  }
+
+  /* Write in whole chunks, the stream inserts a chunk whenever its buffer fills */
+  size_t bufsize = BSON_MAX(size, 1024 * 1024);
+  char *buf = bson_malloc(bufsize);
+  bool ok = true;
+  size_t len;
+  while(ok && (len = fread(buf, 1, bufsize, fp)) > 0){
+    ok = mongoc_stream_write(stream, buf, len, 0) == (ssize_t) len;
+  }
+  ok = ok && !ferror(fp);
+  bson_free(buf);
+  fclose(fp);
+  if(!ok){
+    if(!mongoc_gridfs_bucket_stream_error(stream, &err))
+      bson_set_error(&err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_CORRUPT, "Failed to read %s", fpath);
+    mongoc_gridfs_bucket_abort_upload(stream);
+  }
+
+  /* Closing the stream flushes the last chunk and writes the files document */
+  mongoc_stream_close(stream);
+  if(ok && mongoc_gridfs_bucket_stream_error(stream, &err))
+    ok = false;
+  mongoc_stream_destroy(stream);
+  mongoc_gridfs_bucket_destroy(bucket);
+  if(!ok){
+    bson_value_destroy(&file_id);
+    stop(err.message);
+  }
+
+  bson_t filter = BSON_INITIALIZER;
+  BSON_APPEND_VALUE(&filter, "_id", &file_id);
+  if(sha256)
+    ok = dedup_link(fs, &file_id, sha256, &err);
+  bson_value_destroy(&file_id);
+  if(!ok){
+    bson_destroy(&filter);
+    stop(err.message);
+  }
+  mongoc_gridfs_file_t *file = mongoc_gridfs_find_one_with_opts(fs, &filter, NULL, &err);
+  bson_destroy(&filter);
+  if(file == NULL)
+    stop(err.message);
+  SEXP val = PROTECT(create_outlist(file));
+  mongoc_gridfs_file_destroy(file);
+  UNPROTECT(1);
+  return val;
+}
+
+SEXP R_mongo_bucket_download(SEXP ptr_fs, SEXP name, SEXP path){
+  mongoc_gridfs_t *fs = r2gridfs(ptr_fs);
+  mongoc_client_t *client = r2client(R_ExternalPtrProtected(ptr_fs));
+  const char *fpath = CHAR(STRING_ELT(path, 0));
+  mongoc_gridfs_file_t *file = find_single_file(ptr_fs, name);
+
+  /* The driver streams raw chunks, compressed files are inflated by the transfer code */
+  if(file_codec(file) != CODEC_NONE){
+    mongoc_gridfs_file_destroy(file);
+    return R_mongo_gridfs_download_parallel(ptr_fs, name, path, Rf_ScalarInteger(1));
+  }
+  bson_error_t err;
+  mongoc_gridfs_bucket_t *bucket = new_bucket(fs, client, 0, &err);
+  if(!bucket){
+    mongoc_gridfs_file_destroy(file);
+    stop(err.message);
+  }
+  mongoc_stream_t *stream = mongoc_gridfs_bucket_open_download_stream(bucket, file_content_id(file), &err);
+  if(!stream){
+    mongoc_gridfs_file_destroy(file);
+    mongoc_gridfs_bucket_destroy(bucket);
+    stop(err.message);
+  }
+  FILE *fp = fopen(fpath, "wb");
+  bool ok = fp != NULL;
+  if(!ok)
+    bson_set_error(&err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_INVALID_FILENAME, "Failed to open file %s", fpath);
+
+  /* Read a full chunk per call, the download stream fetches one chunk at a time */
+  size_t bufsize = BSON_MAX(mongoc_gridfs_file_get_chunk_size(file), 1024 * 1024);
+  char *buf = bson_malloc(bufsize);
+  while(ok){
+    ssize_t len = mongoc_stream_read(stream, buf, bufsize, 1, 0);
+    if(len < 0){
+      mongoc_gridfs_bucket_stream_error(stream, &err);
+      ok = false;
+    } else if(len == 0){
+      break;
+    } else if(fwrite(buf, 1, len, fp) != (size_t) len){
+      bson_set_error(&err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_CORRUPT, "Failed to write to %s", fpath);
+      ok = false;
+    }
+  }
+  bson_free(buf);
+  if(fp && fclose(fp) && ok){
+    bson_set_error(&err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_CORRUPT, "Failed to write to %s", fpath);
+    ok = false;
+  }
+  mongoc_stream_destroy(stream);
+  mongoc_gridfs_bucket_destroy(bucket);
+  if(!ok){
+    /* Do not leave a truncated file behind */
+    if(fp)
+      remove(fpath);
+    mongoc_gridfs_file_destroy(file);
+    stop(err.message);
+  }
+  SEXP val = PROTECT(create_outlist(file));
+  mongoc_gridfs_file_destroy(file);
+  UNPROTECT(1);
+  return val;
+}
+
+SEXP R_mongo_bucket_upload(SEXP ptr_fs, SEXP name, SEXP path, SEXP content_type, SEXP meta_ptr, SEXP chunk_size){
+  return bucket_upload(ptr_fs, name, path, content_type, meta_ptr, chunk_size, NULL);
+}
@@ -43,10 +43,6 @@ SEXP R_mongo_client_new(SEXP uri_string, SEXP pem_file, SEXP pem_pwd, SEXP ca_fi
   }
 #endif
 
-  mongoc_client_t *client = mongoc_client_new_from_uri (uri);
-  if(!client)
-    stop("Invalid uri_string. Try mongodb://localhost");
-
   //set ssl certificates here
 #ifdef MONGOC_ENABLE_SSL
   mongoc_ssl_opt_t opt = { 0 };
@@ -64,7 +60,34 @@ SEXP R_mongo_client_new(SEXP uri_string, SEXP pem_file, SEXP pem_pwd, SEXP ca_fi
     opt.allow_invalid_hostname = Rf_asLogical(allow_invalid_hostname);
   if(Rf_length(weak_cert_validation))
     opt.weak_cert_validation = Rf_asLogical(weak_cert_validation);
+#endif
+
+  /* With maxPoolSize in the uri the client is backed by a thread-safe pool */
+  if(mongoc_uri_has_option(uri, MONGOC_URI_MAXPOOLSIZE)){
+    mongoc_client_pool_t *pool = mongoc_client_pool_new_with_error (uri, &err);
+    if(!pool){
+      mongoc_uri_destroy(uri);
+      Rf_error("failed to create client pool: %s", err.message);
+    }
+#ifdef MONGOC_ENABLE_SSL
+    if (mongoc_uri_get_tls (uri)) {
+      mongoc_client_pool_set_ssl_opts(pool, &opt);
+    }
+#endif
+    if (NULL == mongoc_uri_get_appname (uri)) {
+      mongoc_client_pool_set_appname (pool, "r/mongolite");
+    }
+    monitor_pool(pool);
+    mongoc_uri_destroy(uri);
+    return pooled_client2r(pool);
+  }
 
+  mongoc_client_t *client = mongoc_client_new_from_uri (uri);
+  if(!client)
+    stop("Invalid uri_string. Try mongodb://localhost");
+  monitor_client(client);
+
+#ifdef MONGOC_ENABLE_SSL
   if (mongoc_uri_get_tls (mongoc_client_get_uri(client))) {
     mongoc_client_set_ssl_opts(client, &opt);
   }
@@ -37,11 +37,18 @@ SEXP R_mongo_collection_name (SEXP ptr){
   return mkStringUTF8(name);
 }
 
-SEXP R_mongo_collection_count (SEXP ptr, SEXP ptr_filter){
+SEXP R_mongo_collection_count (SEXP ptr, SEXP ptr_filter, SEXP ptr_opts, SEXP estimate, SEXP prefs){
   mongoc_collection_t *col = r2col(ptr);
   bson_t *filter = r2bson(ptr_filter);
+  bson_t *opts = r2bson(ptr_opts);
+  mongoc_read_prefs_t *rp = r2readprefs(prefs);
   bson_error_t err;
-  int64_t count = mongoc_collection_count_documents (col, filter, NULL, NULL, NULL, &err);
+
+  //estimatedDocumentCount only reads collection metadata but ignores the filter
+  int64_t count = Rf_asLogical(estimate) ?
+    mongoc_collection_estimated_document_count (col, opts, rp, NULL, &err) :
+    mongoc_collection_count_documents (col, filter, opts, rp, NULL, &err);
+  mongoc_read_prefs_destroy(rp);
   if (count < 0)
     stop(err.message);
 
@@ -172,11 +179,13 @@ SEXP R_mongo_collection_remove(SEXP ptr_col, SEXP ptr_bson, SEXP just_one){
   return Rf_ScalarLogical(1);
 }
 
-SEXP R_mongo_collection_find(SEXP ptr_col, SEXP ptr_query, SEXP ptr_opts) {
+SEXP R_mongo_collection_find(SEXP ptr_col, SEXP ptr_query, SEXP ptr_opts, SEXP prefs) {
   mongoc_collection_t *col = r2col(ptr_col);
   bson_t *query = r2bson(ptr_query);
   bson_t *opts = r2bson(ptr_opts);
-  mongoc_cursor_t *c = mongoc_collection_find_with_opts(col, query, opts, NULL);
+  mongoc_read_prefs_t *rp = r2readprefs(prefs);
+  mongoc_cursor_t *c = mongoc_collection_find_with_opts(col, query, opts, rp);
+  mongoc_read_prefs_destroy(rp);
   return cursor2r(c, ptr_col);
 }
 
@@ -203,7 +212,7 @@ SEXP R_mongo_collection_rename(SEXP ptr_col, SEXP db, SEXP name) {
   return Rf_ScalarLogical(1);
 }
 
-SEXP R_mongo_collection_aggregate(SEXP ptr_col, SEXP ptr_pipeline, SEXP ptr_options, SEXP no_timeout) {
+SEXP R_mongo_collection_aggregate(SEXP ptr_col, SEXP ptr_pipeline, SEXP ptr_options, SEXP no_timeout, SEXP prefs) {
   mongoc_collection_t *col = r2col(ptr_col);
   bson_t *pipeline = r2bson(ptr_pipeline);
   bson_t *options = r2bson(ptr_options);
@@ -212,12 +221,178 @@ SEXP R_mongo_collection_aggregate(SEXP ptr_col, SEXP ptr_pipeline, SEXP ptr_opti
   if(Rf_asLogical(no_timeout))
     flags += MONGOC_QUERY_NO_CURSOR_TIMEOUT;
 
-  mongoc_cursor_t *c = mongoc_collection_aggregate (col, flags, pipeline, options, NULL);
+  mongoc_read_prefs_t *rp = r2readprefs(prefs);
+  mongoc_cursor_t *c = mongoc_collection_aggregate (col, flags, pipeline, options, rp);
+  mongoc_read_prefs_destroy(rp);
   if(!c)
     stop("Error executing pipeline.");
   return cursor2r(c, ptr_col);
 }
 
+static SEXP values_to_vector(const bson_t *doc, const char *key){
+  bson_iter_t iter;
+  bson_iter_t child1;
+  bson_iter_t child2;
+  if(!bson_iter_init_find(&iter, doc, key) || !BSON_ITER_HOLDS_ARRAY(&iter))
+    return Rf_allocVector(VECSXP, 0);
+  bson_iter_recurse(&iter, &child1);
+  bson_iter_recurse(&iter, &child2);
+  return ConvertAtomic(&child1, &child2);
+}
+
+/* Same result as 'distinct' but streams the values through a cursor, so it is
+ * not subject to the 16MB limit of a single command reply. */
+static mongoc_cursor_t *distinct_cursor(mongoc_collection_t *col, const char *key, const bson_t *query,
+                                        const mongoc_read_prefs_t *rp){
+  bson_t *pipeline = bson_new();
+  bson_array_builder_t *stages;
+  BSON_APPEND_ARRAY_BUILDER_BEGIN(pipeline, "pipeline", &stages);
+  bson_t *stage = BCON_NEW("$match", BCON_DOCUMENT(query));
+  bson_array_builder_append_document(stages, stage);
+  bson_destroy(stage);
+
+  /* Like distinct, arrays are unwound at every level of the path. Explicit nulls
+   * are kept, while documents without the field or with an empty array are not. */
+  char *path = bson_strdup_printf("$%s", key);
+  for(char *dot = strchr(path, '.');; dot = strchr(dot + 1, '.')){
+    if(dot)
+      *dot = '\0';
+    stage = BCON_NEW("$unwind", "{", "path", BCON_UTF8(path), "preserveNullAndEmptyArrays", BCON_BOOL(true), "}");
+    bson_array_builder_append_document(stages, stage);
+    bson_destroy(stage);
+    if(!dot)
+      break;
+    *dot = '.';
+  }
+  stage = BCON_NEW("$match", "{", key, "{", "$exists", BCON_BOOL(true), "}", "}");
+  bson_array_builder_append_document(stages, stage);
+  bson_destroy(stage);
+  stage = BCON_NEW("$group", "{", "_id", BCON_UTF8(path), "}");
+  bson_array_builder_append_document(stages, stage);
+  bson_destroy(stage);
+  bson_append_array_builder_end(pipeline, stages);
+
+  bson_t *opts = BCON_NEW("allowDiskUse", BCON_BOOL(true));
+  mongoc_cursor_t *c = mongoc_collection_aggregate (col, MONGOC_QUERY_NONE, pipeline, opts, rp);
+  bson_free(path);
+  bson_destroy(pipeline);
+  bson_destroy(opts);
+  return c;
+}
+
+/* Turns the first n elements of an atomic vector into a list of values, with
+ * NULL for missing values as in ConvertArray() */
+static SEXP atomic_to_list(SEXP x, R_xlen_t n, bool dates){
+  SEXP out = PROTECT(Rf_allocVector(VECSXP, XLENGTH(x)));
+  for(R_xlen_t i = 0; i < n; i++){
+    switch(TYPEOF(x)){
+    case LGLSXP:
+      if(LOGICAL(x)[i] != NA_LOGICAL)
+        SET_VECTOR_ELT(out, i, Rf_ScalarLogical(LOGICAL(x)[i]));
+      break;
+    case INTSXP:
+      if(INTEGER(x)[i] != NA_INTEGER)
+        SET_VECTOR_ELT(out, i, Rf_ScalarInteger(INTEGER(x)[i]));
+      break;
+    case REALSXP:
+      if(!ISNA(REAL(x)[i]))
+        SET_VECTOR_ELT(out, i, Rf_ScalarReal(REAL(x)[i]));
+      if(dates && VECTOR_ELT(out, i) != R_NilValue)
+        set_posixct(VECTOR_ELT(out, i));
+      break;
+    case STRSXP:
+      if(STRING_ELT(x, i) != NA_STRING)
+        SET_VECTOR_ELT(out, i, Rf_ScalarString(STRING_ELT(x, i)));
+      break;
+    }
+  }
+  UNPROTECT(1);
+  return out;
+}
+
+/* Converts the _id of each document straight into a vector that grows as needed,
+ * so the values are never copied into a single bson array. Types are inferred as
+ * in ConvertAtomic(): the vector is atomic until values of different types are
+ * seen, and then becomes a list. */
+static SEXP cursor_values(mongoc_cursor_t *c){
+  R_xlen_t n = 0;
+  int dates = 0;
+  int values = 0;
+  SEXPTYPE type = NILSXP;
+  PROTECT_INDEX idx;
+  SEXP out = Rf_allocVector(LGLSXP, 1024);
+  PROTECT_WITH_INDEX(out, &idx);
+  const bson_t *doc;
+  bson_iter_t iter;
+  while(mongoc_cursor_next(c, &doc)){
+    if(!bson_iter_init_find(&iter, doc, "_id"))
+      continue;
+    if(n == XLENGTH(out))
+      REPROTECT(out = Rf_xlengthgets(out, 2 * n), idx);
+    SEXPTYPE eltype = TYPEOF(out) == VECSXP ? NILSXP : atomic_type(&iter);
+    if(eltype != NILSXP){
+      bool prev_dates = dates > 0;
+      dates += BSON_ITER_HOLDS_DATE_TIME(&iter);
+      values++;
+      type = atomic_common(type, eltype);
+      if(type == VECSXP || (dates && dates < values)){
+        REPROTECT(out = atomic_to_list(out, n, prev_dates), idx);
+      } else if(type != TYPEOF(out)){
+        REPROTECT(out = Rf_coerceVector(out, type), idx);
+      }
+    }
+    if(TYPEOF(out) == VECSXP){
+      SET_VECTOR_ELT(out, n++, ConvertValue(&iter));
+    } else {
+      set_atomic(out, n++, &iter);
+    }
+  }
+  bson_error_t err;
+  if(mongoc_cursor_error(c, &err)){
+    mongoc_cursor_destroy(c);
+    stop(err.message);
+  }
+  mongoc_cursor_destroy(c);
+  if(type == NILSXP){
+    out = Rf_allocVector(VECSXP, n);
+  } else {
+    REPROTECT(out = Rf_xlengthgets(out, n), idx);
+    if(dates && TYPEOF(out) == REALSXP)
+      set_posixct(out);
+  }
+  UNPROTECT(1);
+  return out;
+}
+
+SEXP R_mongo_collection_distinct(SEXP ptr_col, SEXP key, SEXP ptr_query, SEXP prefs){
+  mongoc_collection_t *col = r2col(ptr_col);
+  bson_t *query = r2bson(ptr_query);
+  const char *field = Rf_translateCharUTF8(Rf_asChar(key));
+  mongoc_read_prefs_t *rp = r2readprefs(prefs);
+  bson_t *cmd = BCON_NEW("distinct", BCON_UTF8(mongoc_collection_get_name(col)),
+    "key", BCON_UTF8(field), "query", BCON_DOCUMENT(query));
+  bson_t reply;
+  bson_error_t err;
+  bool success = mongoc_collection_command_simple(col, cmd, rp, &reply, &err);
+  bson_destroy(cmd);
+  if(!success){
+    bson_destroy(&reply);
+    //distinct too big, 16mb cap
+    if(err.code == 17217 || err.code == 10334){
+      mongoc_cursor_t *c = distinct_cursor(col, field, query, rp);
+      mongoc_read_prefs_destroy(rp);
+      return cursor_values(c);
+    }
+    mongoc_read_prefs_destroy(rp);
+    stop(err.message);
+  }
+  mongoc_read_prefs_destroy(rp);
+  SEXP out = PROTECT(values_to_vector(&reply, "values"));
+  bson_destroy(&reply);
+  UNPROTECT(1);
+  return out;
+}
+
 SEXP R_mongo_collection_command(SEXP ptr_col, SEXP ptr_cmd, SEXP no_timeout){
   mongoc_collection_t *col = r2col(ptr_col);
   bson_t *cmd = r2bson(ptr_cmd);
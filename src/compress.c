@@ -0,0 +1,54 @@
+#include <mongolite.h>
+#include <mongoc/mongoc-gridfs-file-private.h>
+#include <zlib.h>
+
+/* Per-chunk compression of GridFS payloads. Files keep their regular length and
+ * chunkSize (of the uncompressed data), only the 'data' of each chunk is
+ * compressed. The codec is recorded in a 'compression' field of the files
+ * document. Such files can only be read back by this package. */
+
+int codec_from_name(const char *name){
+  if(name == NULL || !strcmp(name, "none"))
+    return CODEC_NONE;
+  if(!strcmp(name, "zlib"))
+    return CODEC_ZLIB;
+  return -1;
+}
+
+const char * codec_name(int codec){
+  return codec == CODEC_ZLIB ? "zlib" : "none";
+}
+
+/* Returns -1 for codecs that we cannot read */
+int file_codec(mongoc_gridfs_file_t *file){
+  bson_iter_t iter;
+  if(!bson_iter_init_find(&iter, &file->bson, "compression"))
+    return CODEC_NONE;
+  return BSON_ITER_HOLDS_UTF8(&iter) ? codec_from_name(bson_iter_utf8(&iter, NULL)) : -1;
+}
+
+/* Compresses a chunk into a new buffer which must be freed with bson_free() */
+uint8_t * chunk_compress(int codec, const uint8_t *data, size_t len, size_t *outlen){
+  if(codec != CODEC_ZLIB)
+    return NULL;
+  uLongf size = compressBound(len);
+  uint8_t *out = bson_malloc(size);
+  if(compress2(out, &size, data, len, Z_DEFAULT_COMPRESSION) != Z_OK){
+    bson_free(out);
+    return NULL;
+  }
+  *outlen = size;
+  return out;
+}
+
+/* Returns the uncompressed payload of a chunk, which is either the data itself
+ * or inflated into scratch (of at least max bytes). NULL if inflating fails. */
+const uint8_t * chunk_payload(int codec, const uint8_t *data, uint32_t *len, uint8_t *scratch, uint32_t max){
+  if(codec == CODEC_NONE)
+    return data;
+  uLongf size = max;
+  if(codec != CODEC_ZLIB || uncompress(scratch, &size, data, *len) != Z_OK)
+    return NULL;
+  *len = size;
+  return scratch;
+}
@@ -0,0 +1,62 @@
+#include <mongolite.h>
+#include <common-atomic-private.h>
+#include <mongoc/mongoc-counters-private.h>
+
+/* Process-wide driver counters. Each counter has a slot per cpu, which are summed
+ * here as int64 because the driver's own _count() helpers truncate to int32. */
+
+typedef struct {
+  mongoc_counter_t *counter;
+  int slot;
+  const char *category;
+  const char *name;
+  const char *description;
+} counter_def;
+
+static counter_def counter_defs[] = {
+#define COUNTER(ident, Category, Name, Description) \
+  {&__mongoc_counter_##ident, COUNTER_##ident % SLOTS_PER_CACHELINE, Category, Name, Description},
+#include <mongoc/mongoc-counters.defs>
+#undef COUNTER
+};
+
+/* Gauges such as the number of active cursors must not be reset */
+static bool counter_is_gauge(const counter_def *def){
+  return !strcmp(def->name, "Active");
+}
+
+static int64_t counter_value(const counter_def *def, bool reset){
+  int64_t sum = 0;
+  unsigned ncpu = _mongoc_get_cpu_count();
+  if(!def->counter->cpus)
+    return 0;
+  for(unsigned i = 0; i < ncpu; i++){
+    int64_t *slot = &def->counter->cpus[i].slots[def->slot];
+    sum += reset ? mcommon_atomic_int64_exchange(slot, 0, mcommon_memory_order_seq_cst) :
+      mcommon_atomic_int64_fetch(slot, mcommon_memory_order_seq_cst);
+  }
+  return sum;
+}
+
+SEXP R_mongo_counters(SEXP reset){
+  int n = LAST_COUNTER;
+  bool do_reset = Rf_asLogical(reset) > 0;
+  SEXP category = PROTECT(Rf_allocVector(STRSXP, n));
+  SEXP name = PROTECT(Rf_allocVector(STRSXP, n));
+  SEXP value = PROTECT(Rf_allocVector(REALSXP, n));
+  SEXP description = PROTECT(Rf_allocVector(STRSXP, n));
+  for(int i = 0; i < n; i++){
+    const counter_def *def = &counter_defs[i];
+    SET_STRING_ELT(category, i, Rf_mkChar(def->category));
+    SET_STRING_ELT(name, i, Rf_mkChar(def->name));
+    SET_STRING_ELT(description, i, Rf_mkChar(def->description));
+    REAL(value)[i] = (double) counter_value(def, do_reset && !counter_is_gauge(def));
+  }
+  SEXP out = PROTECT(Rf_allocVector(VECSXP, 4));
+  SET_VECTOR_ELT(out, 0, category);
+  SET_VECTOR_ELT(out, 1, name);
+  SET_VECTOR_ELT(out, 2, value);
+  SET_VECTOR_ELT(out, 3, description);
+  UNPROTECT(5);
+  return out;
+}
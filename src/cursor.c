@@ -129,3 +129,136 @@ SEXP R_mongo_cursor_next_page(SEXP ptr, SEXP size, SEXP as_json){
   UNPROTECT(2);
   return shortlist;
 }
+
+static SEXPTYPE column_type(const char *type){
+  if(!strcmp(type, "logical"))
+    return LGLSXP;
+  if(!strcmp(type, "integer"))
+    return INTSXP;
+  if(!strcmp(type, "numeric") || !strcmp(type, "double") || !strcmp(type, "POSIXct"))
+    return REALSXP;
+  if(!strcmp(type, "character"))
+    return STRSXP;
+  stopf("Unsupported column type: %s", type);
+}
+
+/* Values that do not fit an R integer become NA and are counted in 'lossy' */
+static int as_integer(bson_iter_t *iter, int *lossy){
+  double val;
+  switch(bson_iter_type(iter)){
+  case BSON_TYPE_BOOL:
+    return bson_iter_bool(iter);
+  case BSON_TYPE_INT32:
+    val = bson_iter_int32(iter);
+    break;
+  case BSON_TYPE_INT64:
+    val = (double) bson_iter_int64(iter);
+    break;
+  default:
+    val = bson_iter_as_double(iter);
+  }
+  if(!R_FINITE(val) || val <= INT_MIN || val > INT_MAX || val != (int) val){
+    (*lossy)++;
+    return NA_INTEGER;
+  }
+  return (int) val;
+}
+
+static void set_column_value(SEXP col, int i, bson_iter_t *iter, const char *field, int *lossy){
+  bson_type_t type = iter ? bson_iter_type(iter) : BSON_TYPE_NULL;
+  switch(TYPEOF(col)){
+  case LGLSXP:
+    if(type == BSON_TYPE_NULL){
+      LOGICAL(col)[i] = NA_LOGICAL;
+    } else if(type == BSON_TYPE_BOOL || BSON_ITER_HOLDS_NUMBER(iter)){
+      LOGICAL(col)[i] = bson_iter_as_bool(iter);
+    } else {
+      break;
+    }
+    return;
+  case INTSXP:
+    if(type == BSON_TYPE_NULL){
+      INTEGER(col)[i] = NA_INTEGER;
+    } else if(type == BSON_TYPE_BOOL || BSON_ITER_HOLDS_NUMBER(iter)){
+      INTEGER(col)[i] = as_integer(iter, lossy);
+    } else {
+      break;
+    }
+    return;
+  case REALSXP:
+    if(type == BSON_TYPE_NULL){
+      REAL(col)[i] = NA_REAL;
+    } else if(type == BSON_TYPE_DATE_TIME){
+      REAL(col)[i] = bson_iter_date_time(iter) / 1000.0;
+    } else if(type == BSON_TYPE_BOOL || BSON_ITER_HOLDS_NUMBER(iter)){
+      REAL(col)[i] = bson_iter_as_double(iter);
+    } else if(type == BSON_TYPE_DECIMAL128){
+      bson_decimal128_t dec;
+      char str[BSON_DECIMAL128_STRING];
+      bson_iter_decimal128(iter, &dec);
+      bson_decimal128_to_string(&dec, str);
+      REAL(col)[i] = strtod(str, NULL);
+    } else {
+      break;
+    }
+    return;
+  case STRSXP:
+    if(type == BSON_TYPE_NULL){
+      SET_STRING_ELT(col, i, NA_STRING);
+    } else if(type == BSON_TYPE_UTF8){
+      uint32_t len;
+      const char *str = bson_iter_utf8(iter, &len);
+      SET_STRING_ELT(col, i, Rf_mkCharLenCE(str, len, CE_UTF8));
+    } else if(type == BSON_TYPE_OID){
+      char str[25];
+      bson_oid_to_string(bson_iter_oid(iter), str);
+      SET_STRING_ELT(col, i, Rf_mkChar(str));
+    } else {
+      break;
+    }
+    return;
+  }
+  stopf("Field '%s' has BSON type 0x%02x which does not match the schema", field, type);
+}
+
+/* Decodes a page of documents directly into typed columns. Fields may use
+ * dot notation for nested values; missing fields become NA. */
+SEXP R_mongo_cursor_next_columns(SEXP ptr, SEXP fields, SEXP types, SEXP size){
+  mongoc_cursor_t *c = r2cursor(ptr);
+  int n = Rf_asInteger(size);
+  int ncol = Rf_length(fields);
+  if(Rf_length(types) != ncol)
+    stop("Arguments 'fields' and 'types' must have equal length");
+  SEXP out = PROTECT(Rf_allocVector(VECSXP, ncol));
+  for(int j = 0; j < ncol; j++)
+    SET_VECTOR_ELT(out, j, Rf_allocVector(column_type(CHAR(STRING_ELT(types, j))), n));
+
+  const bson_t *b = NULL;
+  bson_iter_t iter;
+  bson_iter_t child;
+  int total = 0;
+  int lossy = 0;
+  while(total < n && mongoc_cursor_next(c, &b)){
+    for(int j = 0; j < ncol; j++){
+      const char *field = Rf_translateCharUTF8(STRING_ELT(fields, j));
+      bool found = bson_iter_init(&iter, b) && bson_iter_find_descendant(&iter, field, &child);
+      set_column_value(VECTOR_ELT(out, j), total, found ? &child : NULL, field, &lossy);
+    }
+    total++;
+  }
+
+  bson_error_t err;
+  if(mongoc_cursor_error (c, &err))
+    stop(err.message);
+  if(lossy)
+    Rf_warningcall(R_NilValue, "%d values that are not integers or out of range were set to NA in integer columns", lossy);
+
+  //not a full page
+  if(total < n){
+    for(int j = 0; j < ncol; j++)
+      SET_VECTOR_ELT(out, j, Rf_lengthgets(VECTOR_ELT(out, j), total));
+  }
+  Rf_setAttrib(out, R_NamesSymbol, fields);
+  UNPROTECT(1);
+  return out;
+}
@@ -0,0 +1,429 @@
+#include <mongolite.h>
+#include <mongoc/mongoc-gridfs-file-private.h>
+#include <mongoc/mongoc-util-private.h>
+#ifdef MONGOC_ENABLE_CRYPTO_COMMON_CRYPTO
+#include <CommonCrypto/CommonDigest.h>
+#else
+#include <openssl/evp.h>
+#endif
+
+/* Content addressed storage. The first file with a given sha256 owns the
+ * chunks and counts its references in 'refcount'. Later files with the same
+ * content are stored as a files document with a 'contentId' pointing to the
+ * owner, and no chunks of their own. */
+
+/* Hashing uses the same crypto library as the driver: CommonCrypto on macOS
+ * and libcrypto elsewhere. */
+#ifdef MONGOC_ENABLE_CRYPTO_COMMON_CRYPTO
+
+void * sha256_new(void){
+  CC_SHA256_CTX *ctx = bson_malloc(sizeof(CC_SHA256_CTX));
+  CC_SHA256_Init(ctx);
+  return ctx;
+}
+
+void sha256_update(void *ctx, const void *buf, size_t len){
+  while(len > 0){
+    CC_LONG n = (CC_LONG) BSON_MIN(len, UINT32_MAX);
+    CC_SHA256_Update(ctx, buf, n);
+    buf = (const char *) buf + n;
+    len -= n;
+  }
+}
+
+/* Writes the hex digest and frees the context */
+void sha256_final(void *ctx, char hex[65]){
+  unsigned char md[CC_SHA256_DIGEST_LENGTH];
+  CC_SHA256_Final(md, ctx);
+  bson_free(ctx);
+  for(int i = 0; i < CC_SHA256_DIGEST_LENGTH; i++)
+    snprintf(hex + 2 * i, 3, "%02x", md[i]);
+  hex[64] = '\0';
+}
+
+#else
+
+void * sha256_new(void){
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  if(!ctx || !EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)){
+    EVP_MD_CTX_free(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+void sha256_update(void *ctx, const void *buf, size_t len){
+  EVP_DigestUpdate(ctx, buf, len);
+}
+
+/* Writes the hex digest and frees the context */
+void sha256_final(void *ctx, char hex[65]){
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int len = 0;
+  EVP_DigestFinal_ex(ctx, md, &len);
+  EVP_MD_CTX_free(ctx);
+  for(unsigned int i = 0; i < len && i < 32; i++)
+    snprintf(hex + 2 * i, 3, "%02x", md[i]);
+  hex[64] = '\0';
+}
+
+#endif
+
+static bool sha256_file(const char *path, char hex[65], int64_t *length){
+  FILE *fp = fopen(path, "rb");
+  void *ctx = fp ? sha256_new() : NULL;
+  if(!ctx){
+    if(fp)
+      fclose(fp);
+    return false;
+  }
+  size_t bufsize = 1024 * 1024;
+  char *buf = bson_malloc(bufsize);
+  size_t len;
+  *length = 0;
+  while((len = fread(buf, 1, bufsize, fp)) > 0){
+    sha256_update(ctx, buf, len);
+    *length += len;
+  }
+  bool ok = !ferror(fp);
+  bson_free(buf);
+  fclose(fp);
+  sha256_final(ctx, hex);
+  return ok;
+}
+
+/* The index is created once per gridfs handle, the tag of the pointer records
+ * that it exists. A drop() clears the tag. */
+void dedup_prepare(SEXP ptr_fs){
+  mongoc_gridfs_t *fs = r2gridfs(ptr_fs);
+  if(R_ExternalPtrTag(ptr_fs) != R_NilValue)
+    return;
+  bson_t *keys = BCON_NEW("sha256", BCON_INT32(1));
+  mongoc_index_model_t *model = mongoc_index_model_new(keys, NULL);
+  mongoc_collection_create_indexes_with_opts(mongoc_gridfs_get_files(fs), &model, 1, NULL, NULL, NULL);
+  mongoc_index_model_destroy(model);
+  bson_destroy(keys);
+  R_SetExternalPtrTag(ptr_fs, Rf_ScalarLogical(TRUE));
+}
+
+/* Finds the owner of some content and takes a reference on it */
+static bool acquire_owner(mongoc_collection_t *files, const char *hex, int64_t length,
+                          const bson_value_t *self, bson_t *owner){
+  bson_t *filter = BCON_NEW("sha256", BCON_UTF8(hex), "length", BCON_INT64(length),
+    "contentId", "{", "$exists", BCON_BOOL(false), "}", "refcount", "{", "$gt", BCON_INT32(0), "}");
+  if(self){
+    bson_t ne;
+    BSON_APPEND_DOCUMENT_BEGIN(filter, "_id", &ne);
+    BSON_APPEND_VALUE(&ne, "$ne", self);
+    bson_append_document_end(filter, &ne);
+  }
+  bson_t *update = BCON_NEW("$inc", "{", "refcount", BCON_INT32(1), "}");
+  mongoc_find_and_modify_opts_t *opts = mongoc_find_and_modify_opts_new();
+  mongoc_find_and_modify_opts_set_update(opts, update);
+  bson_t reply;
+  bson_iter_t iter;
+  bool found = mongoc_collection_find_and_modify_with_opts(files, filter, opts, &reply, NULL) &&
+    bson_iter_init_find(&iter, &reply, "value") && BSON_ITER_HOLDS_DOCUMENT(&iter);
+  if(found){
+    uint32_t len;
+    const uint8_t *data;
+    bson_t tmp;
+    bson_iter_document(&iter, &len, &data);
+    bson_init_static(&tmp, data, len);
+    bson_copy_to(&tmp, owner);
+  }
+  bson_destroy(&reply);
+  mongoc_find_and_modify_opts_destroy(opts);
+  bson_destroy(update);
+  bson_destroy(filter);
+  return found;
+}
+
+/* Called after a file was stored with its own chunks: either record it as the
+ * owner of its content, or drop its chunks and refer to an existing owner. */
+bool dedup_link(mongoc_gridfs_t *fs, const bson_value_t *id, const char *hex, bson_error_t *err){
+  mongoc_collection_t *files = mongoc_gridfs_get_files(fs);
+  mongoc_collection_t *chunks = mongoc_gridfs_get_chunks(fs);
+  bson_t filter = BSON_INITIALIZER;
+  BSON_APPEND_VALUE(&filter, "_id", id);
+  bson_t *doc = NULL;
+  mongoc_cursor_t *c = mongoc_collection_find_with_opts(files, &filter, NULL, NULL);
+  const bson_t *res;
+  bson_iter_t iter;
+  int64_t length = -1;
+  if(mongoc_cursor_next(c, &res) && bson_iter_init_find(&iter, res, "length") && BSON_ITER_HOLDS_NUMBER(&iter))
+    length = bson_iter_as_int64(&iter);
+  mongoc_cursor_destroy(c);
+
+  bson_t owner;
+  bool ok;
+  if(length >= 0 && acquire_owner(files, hex, length, id, &owner)){
+    bson_t set;
+    bson_iter_init_find(&iter, &owner, "_id");
+    doc = bson_new();
+    BSON_APPEND_DOCUMENT_BEGIN(doc, "$set", &set);
+    BSON_APPEND_UTF8(&set, "sha256", hex);
+    BSON_APPEND_VALUE(&set, "contentId", bson_iter_value(&iter));
+    bson_append_document_end(doc, &set);
+    ok = mongoc_collection_update_one(files, &filter, doc, NULL, NULL, err);
+    if(ok){
+      bson_t sel = BSON_INITIALIZER;
+      BSON_APPEND_VALUE(&sel, "files_id", id);
+      ok = mongoc_collection_delete_many(chunks, &sel, NULL, NULL, err);
+      bson_destroy(&sel);
+    }
+    bson_destroy(&owner);
+  } else {
+    doc = BCON_NEW("$set", "{", "sha256", BCON_UTF8(hex), "refcount", BCON_INT32(1), "}");
+    ok = mongoc_collection_update_one(files, &filter, doc, NULL, NULL, err);
+  }
+  bson_destroy(doc);
+  bson_destroy(&filter);
+  return ok;
+}
+
+/* The id under which the chunks of a file are stored: its own, or that of the
+ * owner for a file that refers to shared content */
+const bson_value_t * file_content_id(mongoc_gridfs_file_t *file){
+  bson_iter_t iter;
+  if(bson_iter_init_find(&iter, &file->bson, "contentId"))
+    return bson_iter_value(&iter);
+  return mongoc_gridfs_file_get_id(file);
+}
+
+/* Runs a single find_and_modify and copies the matched document, as it was before
+ * the update, into doc. Returns 1 if a document matched, 0 if none, -1 on error. */
+static int modify_one(mongoc_collection_t *files, const bson_t *filter, const bson_t *update,
+                      bson_t *doc, bson_error_t *err){
+  mongoc_find_and_modify_opts_t *opts = mongoc_find_and_modify_opts_new();
+  if(update)
+    mongoc_find_and_modify_opts_set_update(opts, update);
+  else
+    mongoc_find_and_modify_opts_set_flags(opts, MONGOC_FIND_AND_MODIFY_REMOVE);
+  bson_t reply;
+  bson_iter_t iter;
+  int res = -1;
+  if(mongoc_collection_find_and_modify_with_opts(files, filter, opts, &reply, err)){
+    res = bson_iter_init_find(&iter, &reply, "value") && BSON_ITER_HOLDS_DOCUMENT(&iter);
+    if(res && doc){
+      uint32_t len;
+      const uint8_t *data;
+      bson_t tmp;
+      bson_iter_document(&iter, &len, &data);
+      bson_init_static(&tmp, data, len);
+      bson_copy_to(&tmp, doc);
+    }
+  }
+  bson_destroy(&reply);
+  mongoc_find_and_modify_opts_destroy(opts);
+  return res;
+}
+
+static int64_t doc_refcount(const bson_t *doc){
+  bson_iter_t iter;
+  if(bson_iter_init_find(&iter, doc, "refcount") && BSON_ITER_HOLDS_NUMBER(&iter))
+    return bson_iter_as_int64(&iter);
+  return 0;
+}
+
+static bool add_refcount(mongoc_collection_t *files, const bson_value_t *id, int64_t n, bson_error_t *err){
+  bson_t sel = BSON_INITIALIZER;
+  BSON_APPEND_VALUE(&sel, "_id", id);
+  bson_t *upd = BCON_NEW("$inc", "{", "refcount", BCON_INT64(n), "}");
+  bool ok = mongoc_collection_update_one(files, &sel, upd, NULL, NULL, err);
+  bson_destroy(upd);
+  bson_destroy(&sel);
+  return ok;
+}
+
+static bool remove_chunks(mongoc_gridfs_t *fs, const bson_value_t *id, bson_error_t *err){
+  bson_t sel = BSON_INITIALIZER;
+  BSON_APPEND_VALUE(&sel, "files_id", id);
+  bool ok = mongoc_collection_delete_many(mongoc_gridfs_get_chunks(fs), &sel, NULL, NULL, err);
+  bson_destroy(&sel);
+  return ok;
+}
+
+/* The owner hands its chunks over to one of the referring files. The owner is first
+ * retired with a single find_and_modify that only matches while it still has the
+ * expected refcount, after which acquire_owner() no longer picks it. Files that refer
+ * to it and are removed during the handoff decrement the retired owner, and this
+ * balance is passed on to the heir. Returns 0 if the refcount changed meanwhile. */
+static int transfer_owner(mongoc_gridfs_t *fs, const bson_value_t *owner, int64_t refcount, bson_error_t *err){
+  mongoc_collection_t *files = mongoc_gridfs_get_files(fs);
+  mongoc_collection_t *chunks = mongoc_gridfs_get_chunks(fs);
+  bson_t filter = BSON_INITIALIZER;
+  BSON_APPEND_VALUE(&filter, "_id", owner);
+  BSON_APPEND_INT64(&filter, "refcount", refcount);
+  bson_t *upd = BCON_NEW("$set", "{", "refcount", BCON_INT64(0), "}");
+  int res = modify_one(files, &filter, upd, NULL, err);
+  bson_destroy(upd);
+  bson_destroy(&filter);
+  if(res <= 0)
+    return res;
+
+  /* The first referring file becomes the heir and takes over the references */
+  bson_init(&filter);
+  BSON_APPEND_VALUE(&filter, "contentId", owner);
+  upd = BCON_NEW("$unset", "{", "contentId", BCON_UTF8(""), "}",
+                 "$set", "{", "refcount", BCON_INT64(refcount - 1), "}");
+  bson_t heir_doc;
+  res = modify_one(files, &filter, upd, &heir_doc, err);
+  bson_destroy(upd);
+  bool ok = res >= 0;
+  bson_iter_t iter;
+  if(res > 0 && bson_iter_init_find(&iter, &heir_doc, "_id")){
+    bson_value_t heir;
+    bson_value_copy(bson_iter_value(&iter), &heir);
+    bson_destroy(&heir_doc);
+    bson_t sel = BSON_INITIALIZER;
+    bson_t set;
+    BSON_APPEND_VALUE(&sel, "files_id", owner);
+    upd = bson_new();
+    BSON_APPEND_DOCUMENT_BEGIN(upd, "$set", &set);
+    BSON_APPEND_VALUE(&set, "files_id", &heir);
+    bson_append_document_end(upd, &set);
+    ok = mongoc_collection_update_many(chunks, &sel, upd, NULL, NULL, err);
+    bson_reinit(upd);
+    BSON_APPEND_DOCUMENT_BEGIN(upd, "$set", &set);
+    BSON_APPEND_VALUE(&set, "contentId", &heir);
+    bson_append_document_end(upd, &set);
+    ok = ok && mongoc_collection_update_many(files, &filter, upd, NULL, NULL, err);
+    bson_destroy(upd);
+    bson_reinit(&sel);
+    BSON_APPEND_VALUE(&sel, "_id", owner);
+    bson_t owner_doc;
+    res = ok ? modify_one(files, &sel, NULL, &owner_doc, err) : -1;
+    if(res > 0){
+      int64_t balance = doc_refcount(&owner_doc);
+      bson_destroy(&owner_doc);
+      ok = balance == 0 || add_refcount(files, &heir, balance, err);
+    }
+    ok = ok && res >= 0;
+    bson_destroy(&sel);
+    bson_value_destroy(&heir);
+  } else if(res > 0){
+    bson_destroy(&heir_doc);
+  } else if(ok){
+    /* All referring files were removed in the meantime */
+    bson_t sel = BSON_INITIALIZER;
+    BSON_APPEND_VALUE(&sel, "_id", owner);
+    ok = mongoc_collection_delete_one(files, &sel, NULL, NULL, err) && remove_chunks(fs, owner, err);
+    bson_destroy(&sel);
+  }
+  bson_destroy(&filter);
+  return ok ? 1 : -1;
+}
+
+/* Removes a file, taking shared content into account */
+bool dedup_remove(mongoc_gridfs_t *fs, mongoc_gridfs_file_t *file, bson_error_t *err){
+  mongoc_collection_t *files = mongoc_gridfs_get_files(fs);
+  const bson_value_t *id = mongoc_gridfs_file_get_id(file);
+  bson_iter_t iter;
+  bson_t sel = BSON_INITIALIZER;
+  BSON_APPEND_VALUE(&sel, "_id", id);
+
+  /* A referring file decrements the owner it refers to at the time of removal,
+   * unless it has become the owner itself in the meantime */
+  if(bson_iter_init_find(&iter, &file->bson, "contentId")){
+    bson_t guard = BSON_INITIALIZER;
+    bson_t doc;
+    BSON_APPEND_VALUE(&guard, "_id", id);
+    BCON_APPEND(&guard, "contentId", "{", "$exists", BCON_BOOL(true), "}");
+    int res = modify_one(files, &guard, NULL, &doc, err);
+    bson_destroy(&guard);
+    if(res != 0){
+      bson_destroy(&sel);
+      bool ok = res > 0 && (!bson_iter_init_find(&iter, &doc, "contentId") ||
+        add_refcount(files, bson_iter_value(&iter), -1, err));
+      if(res > 0)
+        bson_destroy(&doc);
+      return ok;
+    }
+  } else if(!bson_iter_init_find(&iter, &file->bson, "refcount")){
+    bson_destroy(&sel);
+    return mongoc_gridfs_file_remove(file, err);
+  }
+  /* The refcount guards below fail if another process takes or drops a reference
+   * at the same time, in which case the removal is not retried but reported */
+  int64_t refcount = 0;
+  const bson_t *doc;
+  mongoc_cursor_t *c = mongoc_collection_find_with_opts(files, &sel, NULL, NULL);
+  if(mongoc_cursor_next(c, &doc))
+    refcount = doc_refcount(doc);
+  bool failed = mongoc_cursor_error(c, err);
+  mongoc_cursor_destroy(c);
+  /* A refcount of 0 means the file is already being removed */
+  int res = failed ? -1 : 1;
+  if(!failed && refcount == 1){
+    /* Last reference: remove the owner unless a new one was taken meanwhile */
+    bson_t guard = BSON_INITIALIZER;
+    BSON_APPEND_VALUE(&guard, "_id", id);
+    BSON_APPEND_INT64(&guard, "refcount", 1);
+    res = modify_one(files, &guard, NULL, NULL, err);
+    bson_destroy(&guard);
+    if(res > 0 && !remove_chunks(fs, id, err))
+      res = -1;
+  } else if(!failed && refcount > 1){
+    res = transfer_owner(fs, id, refcount, err);
+  }
+  bson_destroy(&sel);
+  if(res == 0)
+    bson_set_error(err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_PROTOCOL_ERROR,
+                   "Shared content of this file is modified concurrently, try again");
+  return res > 0;
+}
+
+/* Uploads a file unless its content is already stored, in which case only a
+ * files document referring to the existing content is inserted. */
+SEXP R_mongo_gridfs_upload_dedup(SEXP ptr_fs, SEXP name, SEXP path, SEXP content_type, SEXP meta_ptr, SEXP chunk_size){
+  mongoc_gridfs_t *fs = r2gridfs(ptr_fs);
+  mongoc_collection_t *files = mongoc_gridfs_get_files(fs);
+  char hex[65];
+  int64_t length;
+  if(!sha256_file(CHAR(STRING_ELT(path, 0)), hex, &length))
+    stopf("Failed to read file %s", CHAR(STRING_ELT(path, 0)));
+  dedup_prepare(ptr_fs);
+  bson_t owner;
+  if(!acquire_owner(files, hex, length, NULL, &owner))
+    return bucket_upload(ptr_fs, name, path, content_type, meta_ptr, chunk_size, hex);
+
+  bson_iter_t iter;
+  bson_oid_t oid;
+  bson_oid_init(&oid, NULL);
+  bson_t doc = BSON_INITIALIZER;
+  BSON_APPEND_OID(&doc, "_id", &oid);
+  BSON_APPEND_INT64(&doc, "length", length);
+  if(bson_iter_init_find(&iter, &owner, "chunkSize"))
+    BSON_APPEND_VALUE(&doc, "chunkSize", bson_iter_value(&iter));
+  BSON_APPEND_DATE_TIME(&doc, "uploadDate", _mongoc_get_real_time_ms());
+  BSON_APPEND_UTF8(&doc, "filename", Rf_translateCharUTF8(STRING_ELT(name, 0)));
+  if(Rf_length(content_type) && STRING_ELT(content_type, 0) != NA_STRING)
+    BSON_APPEND_UTF8(&doc, "contentType", CHAR(STRING_ELT(content_type, 0)));
+  if(Rf_length(meta_ptr))
+    BSON_APPEND_DOCUMENT(&doc, "metadata", r2bson(meta_ptr));
+  BSON_APPEND_UTF8(&doc, "sha256", hex);
+  bson_iter_init_find(&iter, &owner, "_id");
+  BSON_APPEND_VALUE(&doc, "contentId", bson_iter_value(&iter));
+  bson_error_t err;
+  bool ok = mongoc_collection_insert_one(files, &doc, NULL, NULL, &err);
+  if(!ok){
+    bson_t sel = BSON_INITIALIZER;
+    BSON_APPEND_VALUE(&sel, "_id", bson_iter_value(&iter));
+    bson_t *upd = BCON_NEW("$inc", "{", "refcount", BCON_INT32(-1), "}");
+    mongoc_collection_update_one(files, &sel, upd, NULL, NULL, NULL);
+    bson_destroy(upd);
+    bson_destroy(&sel);
+  }
+  bson_destroy(&owner);
+  if(!ok){
+    bson_destroy(&doc);
+    stop(err.message);
+  }
+  mongoc_gridfs_file_t *file = _mongoc_gridfs_file_new_from_bson(fs, &doc);
+  bson_destroy(&doc);
+  SEXP val = PROTECT(create_outlist(file));
+  mongoc_gridfs_file_destroy(file);
+  UNPROTECT(1);
+  return val;
+}
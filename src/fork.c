@@ -0,0 +1,89 @@
+#include <mongolite.h>
+#include <mongoc/mongoc-client-private.h>
+#include <mongoc/mongoc-cluster-private.h>
+#include <mongoc/mongoc-topology-private.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+/* Fork safety. A child process created with fork(), e.g. by parallel::mclapply,
+ * inherits the clients of the parent including their open sockets, which must
+ * not be used by two processes at once. Each client records the pid of the
+ * process that created it. When the client is used in another process, its
+ * connections are closed and its server sessions are dropped. The driver does
+ * not shutdown sockets that were opened by another pid, so this does not affect
+ * the connections of the parent. The topology and the global cache of SCRAM keys
+ * are kept, so the child only needs to open and authenticate a connection. */
+
+static SEXP pid_symbol(void){
+  static SEXP sym = NULL;
+  if(sym == NULL)
+    sym = Rf_install("pid");
+  return sym;
+}
+
+void client_set_pid(SEXP ptr_client){
+#ifndef _WIN32
+  Rf_setAttrib(ptr_client, pid_symbol(), Rf_ScalarInteger(getpid()));
+#endif
+}
+
+#ifndef _WIN32
+static void disconnect_nodes(mongoc_client_t *client){
+  size_t n = 0;
+  mongoc_server_description_t **servers = mongoc_client_get_server_descriptions(client, &n);
+  for(size_t i = 0; i < n; i++)
+    mongoc_cluster_disconnect_node(&client->cluster, mongoc_server_description_id(servers[i]));
+  mongoc_server_descriptions_destroy_all(servers, n);
+}
+
+/* Same as mongoc_client_reset(), which is a no-op for pooled clients. Bumping the
+ * generation makes the driver skip killCursors and endSessions for cursors and
+ * sessions that were created by the parent. */
+static void reset_client(mongoc_client_t *client){
+  if(client->topology->single_threaded){
+    mongoc_client_reset(client);
+  } else {
+    client->generation++;
+    mongoc_set_destroy(client->client_sessions);
+    client->client_sessions = mongoc_set_new(8, NULL, NULL);
+    mongoc_server_session_pool_clear(client->topology->session_pool);
+  }
+  disconnect_nodes(client);
+}
+
+static void check_client(SEXP ptr_client){
+  SEXP pid = Rf_getAttrib(ptr_client, pid_symbol());
+  if(TYPEOF(pid) != INTSXP || Rf_asInteger(pid) == getpid())
+    return;
+  mongoc_client_t *client = R_ExternalPtrAddr(ptr_client);
+  if(client){
+    reset_client(client);
+    /* The monitoring threads of the pool only exist in the parent. The pool (or
+     * the private pool of a single client) is detached and leaked, the client
+     * keeps working with the topology as last seen by the parent, and operations
+     * that need more connections create a pool of their own. */
+    SEXP tag = R_ExternalPtrTag(ptr_client);
+    if(TYPEOF(tag) == EXTPTRSXP){
+      R_ClearExternalPtr(tag);
+      R_SetExternalPtrTag(ptr_client, R_NilValue);
+    }
+  }
+  client_set_pid(ptr_client);
+}
+#endif
+
+/* Accepts a client or any object that (indirectly) protects one, such as a
+ * collection, gridfs or cursor. */
+void client_check_fork(SEXP ptr){
+#ifndef _WIN32
+  while(TYPEOF(ptr) == EXTPTRSXP){
+    if(Rf_inherits(ptr, "mongo_client")){
+      check_client(ptr);
+      return;
+    }
+    ptr = R_ExternalPtrProtected(ptr);
+  }
+#endif
+}
@@ -1,4 +1,11 @@
 #include <mongolite.h>
+#include <R_ext/Connections.h>
+
+/* Custom connections are only available with this version of the API, otherwise
+ * R_gridfs_connection() returns NULL and R falls back on an in-memory copy */
+#if defined(R_CONNECTIONS_VERSION) && R_CONNECTIONS_VERSION == 1
+#define HAVE_CUSTOM_CONNECTIONS
+#endif
 
 static SEXP make_string(const char * x){
   return Rf_ScalarString(x ? Rf_mkCharCE(x, CE_UTF8) : NA_STRING);
@@ -32,7 +39,7 @@ static SEXP get_file_id(mongoc_gridfs_file_t * file){
   return Rf_length(lst) ? VECTOR_ELT(bson2list(&val), 0) : R_NilValue;
 }
 
-static SEXP create_outlist(mongoc_gridfs_file_t * file){
+SEXP create_outlist(mongoc_gridfs_file_t * file){
   SEXP out = PROTECT(Rf_allocVector(VECSXP, 6));
   SET_VECTOR_ELT(out, 0, get_file_id(file));
   SET_VECTOR_ELT(out, 1, make_string(mongoc_gridfs_file_get_filename(file)));
@@ -52,8 +59,9 @@ static SEXP create_outlist(mongoc_gridfs_file_t * file){
   return out;
 }
 
-/* find either by string or by query */
-static mongoc_gridfs_file_t * find_single_file(SEXP ptr_fs, SEXP name){
+/* find either by string or by query. Deduplicated files must be read from the
+ * chunks of file_content_id() */
+mongoc_gridfs_file_t * find_single_file(SEXP ptr_fs, SEXP name){
   mongoc_gridfs_t *fs = r2gridfs(ptr_fs);
   bson_error_t err;
   mongoc_gridfs_file_t * file = Rf_isString(name) ?
@@ -64,12 +72,20 @@ static mongoc_gridfs_file_t * find_single_file(SEXP ptr_fs, SEXP name){
   return file;
 }
 
-SEXP R_mongo_gridfs_new(SEXP ptr_client, SEXP prefix, SEXP db) {
+SEXP R_mongo_gridfs_new(SEXP ptr_client, SEXP prefix, SEXP db, SEXP prefs) {
   mongoc_client_t *client = r2client(ptr_client);
+  mongoc_read_prefs_t *rp = r2readprefs(prefs);
   bson_error_t err;
   mongoc_gridfs_t * fs = mongoc_client_get_gridfs(client, get_string(db), get_string(prefix), &err);
-  if(fs == NULL)
+  if(fs == NULL){
+    mongoc_read_prefs_destroy(rp);
     stop(err.message);
+  }
+  if(rp){
+    mongoc_collection_set_read_prefs(mongoc_gridfs_get_files(fs), rp);
+    mongoc_collection_set_read_prefs(mongoc_gridfs_get_chunks(fs), rp);
+    mongoc_read_prefs_destroy(rp);
+  }
   return gridfs2r(fs, ptr_client);
 }
 
@@ -77,6 +93,7 @@ SEXP R_mongo_gridfs_drop (SEXP ptr_fs){
   mongoc_gridfs_t *fs = r2gridfs(ptr_fs);
   bson_error_t err;
   int res = mongoc_gridfs_drop(fs, &err);
+  R_SetExternalPtrTag(ptr_fs, R_NilValue);
   if(!res && err.code != 26)
     stop(err.message);
   return Rf_ScalarLogical(res);
@@ -84,9 +101,13 @@ SEXP R_mongo_gridfs_drop (SEXP ptr_fs){
 
 SEXP R_mongo_gridfs_find(SEXP ptr_fs, SEXP ptr_filter, SEXP ptr_opts){
   mongoc_gridfs_t *fs = r2gridfs(ptr_fs);
-  bson_t *filter = r2bson(ptr_filter);
   bson_t *opts = r2bson(ptr_opts);
+
+  /* Hide the stubs of unfinished resumable uploads */
+  bson_t *filter = BCON_NEW("$and", "[", BCON_DOCUMENT(r2bson(ptr_filter)),
+    "{", "pending", "{", "$exists", BCON_BOOL(false), "}", "}", "]");
   mongoc_gridfs_file_list_t * list = mongoc_gridfs_find_with_opts (fs, filter, opts);
+  bson_destroy(filter);
 
   /* Protect HEAD sentinel nodes for each list */
   mongoc_gridfs_file_t * file;
@@ -101,70 +122,13 @@ SEXP R_mongo_gridfs_find(SEXP ptr_fs, SEXP ptr_filter, SEXP ptr_opts){
   return CDR(head); // CDR() drops sentinel node
 }
 
-SEXP R_mongo_gridfs_upload(SEXP ptr_fs, SEXP name, SEXP path, SEXP content_type, SEXP meta_ptr){
-  mongoc_gridfs_t *fs = r2gridfs(ptr_fs);
-  mongoc_stream_t * stream = mongoc_stream_file_new_for_path(CHAR(STRING_ELT(path, 0)), O_RDONLY, 0);
-  if(stream == NULL)
-    stop("Failure at mongoc_stream_file_new_for_path()");
-
-  mongoc_gridfs_file_opt_t opt = {0};
-  opt.filename = get_string(name);
-  mongoc_gridfs_file_t * file = mongoc_gridfs_create_file_from_stream (fs, stream, &opt);
-  if(file == NULL)
-    stop("Failure at mongoc_gridfs_create_file_from_stream()");
-  if(Rf_length(content_type) && STRING_ELT(content_type, 0) != NA_STRING)
-    mongoc_gridfs_file_set_content_type(file, CHAR(STRING_ELT(content_type, 0)));
-  if(Rf_length(meta_ptr))
-    mongoc_gridfs_file_set_metadata(file, r2bson(meta_ptr));
-  if(!mongoc_gridfs_file_save (file)){
-    bson_error_t err;
-    mongoc_gridfs_file_error(file, &err);
-    mongoc_gridfs_file_destroy (file);
-    stop(err.message);
-  }
-  SEXP val = PROTECT(create_outlist(file));
-  mongoc_gridfs_file_destroy (file);
-  UNPROTECT(1);
-  return val;
-}
-
-SEXP R_mongo_gridfs_download(SEXP ptr_fs, SEXP name, SEXP path){
-  mongoc_gridfs_file_t *file = find_single_file(ptr_fs, name);
-  mongoc_stream_t * stream = mongoc_stream_gridfs_new (file);
-  if(!stream)
-    stop("Failed to create mongoc_stream_gridfs_new");
-
-  char buf[4096];
-  FILE * fp = fopen(get_string(path), "wb");
-  if(!fp)
-    stopf("Failed to open file %s", get_string(path));
-
-  for(;;) {
-    int nbytes = mongoc_stream_read(stream, buf, 4096, -1, 0);
-    if(nbytes == 0)
-      break;
-    if(nbytes < 0){
-      fclose(fp);
-      stop("Error in mongoc_stream_readv()");
-    }
-    if (fwrite (buf, 1, nbytes, fp) != nbytes){
-      fclose(fp);
-      stop("Failed to write to file");
-    }
-  }
-  fclose(fp);
-  mongoc_stream_destroy (stream);
-  SEXP val = PROTECT(create_outlist(file));
-  mongoc_gridfs_file_destroy(file);
-  UNPROTECT(1);
-  return val;
-}
-
 SEXP R_mongo_gridfs_remove(SEXP ptr_fs, SEXP name){
   bson_error_t err;
   mongoc_gridfs_file_t *file = find_single_file(ptr_fs, name);
-  if(!mongoc_gridfs_file_remove(file, &err))
+  if(!dedup_remove(r2gridfs(ptr_fs), file, &err)){
+    mongoc_gridfs_file_destroy (file);
     stop(err.message);
+  }
   SEXP val = PROTECT(create_outlist(file));
   mongoc_gridfs_file_destroy (file);
   UNPROTECT(1);
@@ -173,11 +137,35 @@ SEXP R_mongo_gridfs_remove(SEXP ptr_fs, SEXP name){
 
 /* Connection Streaming API */
 
+/* Recently used chunks, for random access reads */
+typedef struct {
+  int32_t n;
+  uint32_t len;
+  uint64_t used;
+  uint8_t * data;
+} chunk_slot;
+
 typedef struct {
   mongoc_stream_t * stream;
   mongoc_gridfs_file_t * file;
+  mongoc_gridfs_file_t * info;
+  chunk_slot * cache;
+  int cache_size;
+  uint64_t clock;
+  void * sha256;
+  int codec;
+  int64_t pos;
+  uint8_t * scratch;
 } filestream;
 
+static void free_cache(filestream * filestr){
+  for(int i = 0; i < filestr->cache_size; i++)
+    free(filestr->cache[i].data);
+  free(filestr->cache);
+  filestr->cache = NULL;
+  filestr->cache_size = 0;
+}
+
 static void fin_filestream(SEXP ptr){
 #ifdef MONGOLITE_DEBUG
   MONGOC_MESSAGE ("destorying stream.");
@@ -189,6 +177,14 @@ static void fin_filestream(SEXP ptr){
     mongoc_stream_destroy(filestr->stream);
   if(filestr->file)
     mongoc_gridfs_file_destroy(filestr->file);
+  if(filestr->info)
+    mongoc_gridfs_file_destroy(filestr->info);
+  free_cache(filestr);
+  free(filestr->scratch);
+  if(filestr->sha256){
+    char hex[65];
+    sha256_final(filestr->sha256, hex);
+  }
   free(filestr);
   R_SetExternalPtrProtected(ptr, R_NilValue);
   R_ClearExternalPtr(ptr);
@@ -201,17 +197,31 @@ static filestream * get_stream_ptr(SEXP ptr){
   return filestr;
 }
 
-static SEXP R_make_stream_ptr(mongoc_gridfs_file_t * file, SEXP ptr_fs){
+/* The stream reads the chunks of 'file', while 'info' is the files document that
+ * is reported to R, if different */
+static SEXP R_make_stream_ptr(mongoc_gridfs_file_t * file, mongoc_gridfs_file_t * info, SEXP ptr_fs){
   mongoc_stream_t *stream = mongoc_stream_gridfs_new (file);
   if(!stream){
     mongoc_gridfs_file_destroy(file);
+    if(info)
+      mongoc_gridfs_file_destroy(info);
     stop("Failed to create mongoc_stream_gridfs_new");
   }
   double size = mongoc_gridfs_file_get_length(file);
   if(size < 0)
     size = NA_REAL;
-  filestream * filestr = malloc(sizeof (filestream));
+  filestream * filestr = calloc(1, sizeof (filestream));
+  filestr->codec = file_codec(file);
+  if(filestr->codec < 0){
+    mongoc_stream_destroy(stream);
+    mongoc_gridfs_file_destroy(file);
+    if(info)
+      mongoc_gridfs_file_destroy(info);
+    free(filestr);
+    stop("Unsupported compression in files document");
+  }
   filestr->file = file;
+  filestr->info = info;
   filestr->stream = stream;
   SEXP ptr = PROTECT(R_MakeExternalPtr(filestr, R_NilValue, ptr_fs));
   R_RegisterCFinalizerEx(ptr, fin_filestream, 1);
@@ -221,15 +231,35 @@ static SEXP R_make_stream_ptr(mongoc_gridfs_file_t * file, SEXP ptr_fs){
   return ptr;
 }
 
+/* A deduplicated file is read through the files document of the owner of its
+ * content, which has the same length and chunkSize */
 SEXP R_new_read_stream(SEXP ptr_fs, SEXP name){
   mongoc_gridfs_file_t * file = find_single_file(ptr_fs, name);
-  return R_make_stream_ptr(file, ptr_fs);
+  const bson_value_t * content = file_content_id(file);
+  if(content == mongoc_gridfs_file_get_id(file))
+    return R_make_stream_ptr(file, NULL, ptr_fs);
+  bson_error_t err;
+  bson_t filter = BSON_INITIALIZER;
+  BSON_APPEND_VALUE(&filter, "_id", content);
+  mongoc_gridfs_file_t * owner = mongoc_gridfs_find_one_with_opts(r2gridfs(ptr_fs), &filter, NULL, &err);
+  bson_destroy(&filter);
+  if(owner == NULL){
+    mongoc_gridfs_file_destroy(file);
+    stopf("Content of deduplicated file not found. %s", err.message);
+  }
+  return R_make_stream_ptr(owner, file, ptr_fs);
 }
 
-SEXP R_new_write_stream(SEXP ptr_fs, SEXP name, SEXP content_type, SEXP meta_ptr){
+SEXP R_new_write_stream(SEXP ptr_fs, SEXP name, SEXP content_type, SEXP meta_ptr, SEXP chunk_size, SEXP dedup){
   mongoc_gridfs_t *fs = r2gridfs(ptr_fs);
   mongoc_gridfs_file_opt_t opt = {0};
   opt.filename = get_string(name);
+  if(Rf_length(chunk_size)){
+    int size = Rf_asInteger(chunk_size);
+    if(size <= 0 || size > 16 * 1024 * 1024 - 1024)
+      stop("Invalid chunk size");
+    opt.chunk_size = size;
+  }
   mongoc_gridfs_file_t * file = mongoc_gridfs_create_file (fs, &opt);
   if(file == NULL)
     stop("Failure at mongoc_gridfs_create_file()");
@@ -237,16 +267,92 @@ SEXP R_new_write_stream(SEXP ptr_fs, SEXP name, SEXP content_type, SEXP meta_ptr
     mongoc_gridfs_file_set_content_type(file, CHAR(STRING_ELT(content_type, 0)));
   if(Rf_length(meta_ptr))
     mongoc_gridfs_file_set_metadata(file, r2bson(meta_ptr));
-  return R_make_stream_ptr(file, ptr_fs);
+  SEXP ptr = PROTECT(R_make_stream_ptr(file, NULL, ptr_fs));
+  if(Rf_asLogical(dedup) > 0){
+    dedup_prepare(ptr_fs);
+    if(!(get_stream_ptr(ptr)->sha256 = sha256_new()))
+      stop("Failed to initiate sha256");
+  }
+  UNPROTECT(1);
+  return ptr;
+}
+
+/* The functions below do not raise R errors, so they can be used by the
+ * callbacks of a connection. Failures are returned in 'err'. */
+static mongoc_gridfs_t * stream_gridfs(SEXP ptr, bson_error_t * err){
+  mongoc_gridfs_t * fs = R_ExternalPtrAddr(R_ExternalPtrProtected(ptr));
+  if(!fs)
+    bson_set_error(err, MONGOC_ERROR_CLIENT, MONGOC_ERROR_CLIENT_NOT_READY, "This grid has been destroyed.");
+  return fs;
+}
+
+/* Content is hashed while it is written if the stream deduplicates */
+static bool stream_write(filestream * filestr, const void * buf, size_t len, bson_error_t * err){
+  if(filestr->sha256)
+    sha256_update(filestr->sha256, buf, len);
+  ssize_t res = mongoc_stream_write (filestr->stream, (void *) buf, len, 0);
+  if(res < 0 && mongoc_gridfs_file_error(filestr->file, err))
+    return false;
+  if(res < (ssize_t) len){
+    bson_set_error(err, MONGOC_ERROR_STREAM, MONGOC_ERROR_STREAM_SOCKET, res < 0 ? "Error writing to stream" : "Incomplete stream write");
+    return false;
+  }
+  return true;
+}
+
+static bool stream_save(SEXP ptr, filestream * filestr, bson_error_t * err){
+  if(!mongoc_gridfs_file_save (filestr->file)){
+    mongoc_gridfs_file_error(filestr->file, err);
+    return false;
+  }
+  if(filestr->sha256){
+    char hex[65];
+    sha256_final(filestr->sha256, hex);
+    filestr->sha256 = NULL;
+    mongoc_gridfs_t * fs = stream_gridfs(ptr, err);
+    if(!fs || !dedup_link(fs, mongoc_gridfs_file_get_id(filestr->file), hex, err))
+      return false;
+  }
+  return true;
+}
+
+static bool read_range(SEXP ptr, filestream * filestr, int64_t start, int64_t end, uint8_t * out, bson_error_t * err);
+
+/* Compressed files cannot be read by the driver, these are read by range instead */
+static int64_t stream_tell(filestream * filestr){
+  return filestr->codec ? filestr->pos : (int64_t) mongoc_gridfs_file_tell(filestr->file);
+}
+
+static ssize_t stream_read(SEXP ptr, filestream * filestr, uint8_t * buf, size_t len, bson_error_t * err){
+  if(!filestr->codec){
+    ssize_t res = mongoc_stream_read(filestr->stream, buf, len, len, 0);
+    if(res < 0 && !mongoc_gridfs_file_error(filestr->file, err))
+      bson_set_error(err, MONGOC_ERROR_STREAM, MONGOC_ERROR_STREAM_SOCKET, "Error reading from stream");
+    return res;
+  }
+  int64_t end = BSON_MIN(mongoc_gridfs_file_get_length(filestr->file), filestr->pos + (int64_t) len);
+  if(end <= filestr->pos)
+    return 0;
+  /* Keep the last chunk around so sequential reads inflate each chunk once */
+  if(!filestr->cache){
+    filestr->cache = calloc(1, sizeof(chunk_slot));
+    filestr->cache_size = filestr->cache ? 1 : 0;
+  }
+  if(!read_range(ptr, filestr, filestr->pos, end, buf, err))
+    return -1;
+  ssize_t res = end - filestr->pos;
+  filestr->pos = end;
+  return res;
 }
 
 SEXP R_stream_read_chunk(SEXP ptr, SEXP n){
   double bufsize = Rf_asReal(n);
   filestream * filestr = get_stream_ptr(ptr);
   SEXP buf = PROTECT(Rf_allocVector(RAWSXP, bufsize));
-  ssize_t len = mongoc_stream_read (filestr->stream, RAW(buf), bufsize, -1, 0);
+  bson_error_t err;
+  ssize_t len = stream_read(ptr, filestr, RAW(buf), bufsize, &err);
   if(len < 0)
-    Rf_error("Error reading from stream");
+    stop(err.message);
   if(len < bufsize){
     SEXP orig = buf;
     buf = Rf_allocVector(RAWSXP, len);
@@ -256,28 +362,396 @@ SEXP R_stream_read_chunk(SEXP ptr, SEXP n){
   return buf;
 }
 
+/* Reads the remainder of the file straight into a single preallocated vector */
+SEXP R_stream_read_all(SEXP ptr){
+  filestream * filestr = get_stream_ptr(ptr);
+  int64_t size = mongoc_gridfs_file_get_length(filestr->file) - stream_tell(filestr);
+  if(size < 0)
+    stop("Invalid file length");
+  SEXP buf = PROTECT(Rf_allocVector(RAWSXP, size));
+  int64_t total = 0;
+  bson_error_t err;
+  while(total < size){
+    size_t step = BSON_MIN(size - total, 1024 * 1024);
+    ssize_t len = stream_read(ptr, filestr, RAW(buf) + total, step, &err);
+    if(len < 0)
+      stop(err.message);
+    if(len == 0)
+      stopf("Stream read incomplete: %.0f remaining", (double) (size - total));
+    total += len;
+    R_CheckUserInterrupt();
+  }
+  UNPROTECT(1);
+  return buf;
+}
+
+static chunk_slot * cache_lookup(filestream * filestr, int32_t n){
+  for(int i = 0; i < filestr->cache_size; i++){
+    chunk_slot * slot = &filestr->cache[i];
+    if(slot->data && slot->n == n){
+      slot->used = ++filestr->clock;
+      return slot;
+    }
+  }
+  return NULL;
+}
+
+/* Stores a chunk in the least recently used slot */
+static void cache_store(filestream * filestr, int32_t n, const uint8_t * data, uint32_t len){
+  if(!filestr->cache_size)
+    return;
+  chunk_slot * slot = &filestr->cache[0];
+  for(int i = 1; i < filestr->cache_size; i++){
+    if(filestr->cache[i].used < slot->used)
+      slot = &filestr->cache[i];
+  }
+  uint8_t * buf = realloc(slot->data, len ? len : 1);
+  if(!buf)
+    return;
+  memcpy(buf, data, len);
+  slot->data = buf;
+  slot->n = n;
+  slot->len = len;
+  slot->used = ++filestr->clock;
+}
+
+/* Fetches chunks [first, last) of the file and copies the requested bytes into out */
+static bool fetch_chunks(SEXP ptr, filestream * filestr, int32_t first, int32_t last,
+                         int64_t offset, int64_t end, uint8_t * out, bson_error_t * err){
+  mongoc_gridfs_t * fs = stream_gridfs(ptr, err);
+  if(!fs)
+    return false;
+  mongoc_collection_t * chunks = mongoc_gridfs_get_chunks(fs);
+  int64_t length = mongoc_gridfs_file_get_length(filestr->file);
+  int32_t chunk_size = mongoc_gridfs_file_get_chunk_size(filestr->file);
+  bson_t filter = BSON_INITIALIZER;
+  bson_t range;
+  BSON_APPEND_VALUE(&filter, "files_id", mongoc_gridfs_file_get_id(filestr->file));
+  BSON_APPEND_DOCUMENT_BEGIN(&filter, "n", &range);
+  BSON_APPEND_INT32(&range, "$gte", first);
+  BSON_APPEND_INT32(&range, "$lt", last);
+  bson_append_document_end(&filter, &range);
+  bson_t *opts = BCON_NEW("sort", "{", "n", BCON_INT32(1), "}",
+    "projection", "{", "_id", BCON_INT32(0), "n", BCON_INT32(1), "data", BCON_INT32(1), "}");
+  mongoc_cursor_t *c = mongoc_collection_find_with_opts(chunks, &filter, opts, NULL);
+  bson_destroy(&filter);
+  bson_destroy(opts);
+  const bson_t *doc;
+  bson_iter_t iter;
+  /* Compressed chunks are inflated into a buffer that lives as long as the stream */
+  if(filestr->codec && !filestr->scratch && !(filestr->scratch = malloc(chunk_size))){
+    mongoc_cursor_destroy(c);
+    bson_set_error(err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_CORRUPT, "Failed to allocate chunk buffer");
+    return false;
+  }
+  uint8_t *scratch = filestr->scratch;
+  int32_t n = first;
+  while(n < last && mongoc_cursor_next(c, &doc)){
+    bson_subtype_t subtype;
+    uint32_t len = 0;
+    const uint8_t *data = NULL;
+    if(!bson_iter_init_find(&iter, doc, "n") || !BSON_ITER_HOLDS_NUMBER(&iter) || bson_iter_as_int64(&iter) != n)
+      break;
+    if(bson_iter_init_find(&iter, doc, "data") && BSON_ITER_HOLDS_BINARY(&iter))
+      bson_iter_binary(&iter, &subtype, &len, &data);
+    if(data)
+      data = chunk_payload(filestr->codec, data, &len, scratch, chunk_size);
+    int64_t start = (int64_t) n * chunk_size;
+    if(!data || len != BSON_MIN(chunk_size, length - start)){
+      mongoc_cursor_destroy(c);
+      bson_set_error(err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_CORRUPT, "Chunk %d has unexpected size", n);
+      return false;
+    }
+    int64_t from = BSON_MAX(offset, start);
+    int64_t to = BSON_MIN(end, start + len);
+    memcpy(out + (from - offset), data + (from - start), to - from);
+    cache_store(filestr, n, data, len);
+    n++;
+  }
+  if(mongoc_cursor_error(c, err)){
+    mongoc_cursor_destroy(c);
+    return false;
+  }
+  mongoc_cursor_destroy(c);
+  if(n < last){
+    bson_set_error(err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_CHUNK_MISSING, "Missing chunk number %d", n);
+    return false;
+  }
+  return true;
+}
+
+/* Copies bytes [start, end) into out, fetching only the chunks that are not cached */
+static bool read_range(SEXP ptr, filestream * filestr, int64_t start, int64_t end, uint8_t * out, bson_error_t * err){
+  int32_t chunk_size = mongoc_gridfs_file_get_chunk_size(filestr->file);
+  if(end > start && chunk_size <= 0){
+    bson_set_error(err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_CORRUPT, "Invalid chunkSize in files document");
+    return false;
+  }
+  int32_t first = end > start ? start / chunk_size : 0;
+  int32_t last = end > start ? (end - 1) / chunk_size + 1 : 0;
+  for(int32_t i = first; i < last;){
+    chunk_slot * slot = cache_lookup(filestr, i);
+    if(slot){
+      int64_t pos = (int64_t) i * chunk_size;
+      int64_t from = BSON_MAX(start, pos);
+      int64_t to = BSON_MIN(end, pos + slot->len);
+      memcpy(out + (from - start), slot->data + (from - pos), to - from);
+      i++;
+      continue;
+    }
+
+    /* Fetch the run of chunks up to the next cached one with a single query */
+    int32_t stop_at = i + 1;
+    while(stop_at < last && !cache_lookup(filestr, stop_at))
+      stop_at++;
+    if(!fetch_chunks(ptr, filestr, i, stop_at, start, end, out, err))
+      return false;
+    i = stop_at;
+  }
+  return true;
+}
+
+/* Sizes the LRU cache of chunks for random access reads, once per reader */
+SEXP R_stream_set_cache(SEXP ptr, SEXP cache_size){
+  filestream * filestr = get_stream_ptr(ptr);
+  int size = Rf_asInteger(cache_size);
+  if(size < 0)
+    stop("Invalid cache size");
+  free_cache(filestr);
+  if(size > 0){
+    filestr->cache = calloc(size, sizeof(chunk_slot));
+    filestr->cache_size = filestr->cache ? size : 0;
+  }
+  return ptr;
+}
+
+/* Reads bytes [offset, offset + n) using only the chunks that cover the range */
+SEXP R_stream_read_range(SEXP ptr, SEXP offset, SEXP n){
+  filestream * filestr = get_stream_ptr(ptr);
+  int64_t length = mongoc_gridfs_file_get_length(filestr->file);
+  int64_t start = Rf_asReal(offset);
+  if(start < 0 || Rf_asReal(n) < 0)
+    stop("Offset and length must be positive");
+  int64_t end = BSON_MIN(length, start + (int64_t) Rf_asReal(n));
+  SEXP buf = PROTECT(Rf_allocVector(RAWSXP, BSON_MAX(0, end - start)));
+  bson_error_t err;
+  if(!read_range(ptr, filestr, start, end, RAW(buf), &err))
+    stop(err.message);
+  UNPROTECT(1);
+  return buf;
+}
+
 SEXP R_stream_write_chunk(SEXP ptr, SEXP buf){
   ssize_t len = 0;
   filestream * filestr = get_stream_ptr(ptr);
+  bson_error_t err;
   if(Rf_length(buf)){
-    len = mongoc_stream_write (filestr->stream, RAW(buf), Rf_length(buf), 0);
-    if(len < 0)
-      Rf_error("Error writing to stream");
-    if(len < Rf_length(buf))
-      Rf_error("Incomplete stream write");
-  } else {
-    if(!mongoc_gridfs_file_save (filestr->file)){
-      bson_error_t err;
-      mongoc_gridfs_file_error(filestr->file, &err);
+    if(!stream_write(filestr, RAW(buf), Rf_length(buf), &err))
       stop(err.message);
-    }
+    len = Rf_length(buf);
+  } else if(!stream_save(ptr, filestr, &err)){
+    stop(err.message);
   }
   return Rf_ScalarInteger(len);
 }
 
+static mongoc_gridfs_file_t * stream_info_file(SEXP ptr){
+  filestream * filestr = get_stream_ptr(ptr);
+  return filestr->info ? filestr->info : filestr->file;
+}
+
+SEXP R_stream_info(SEXP ptr){
+  return create_outlist(stream_info_file(ptr));
+}
+
 SEXP R_stream_close(SEXP ptr){
-  SEXP val = PROTECT(create_outlist(get_stream_ptr(ptr)->file));
+  SEXP val = PROTECT(create_outlist(stream_info_file(ptr)));
   fin_filestream(ptr);
   UNPROTECT(1);
   return val;
 }
+
+#ifdef HAVE_CUSTOM_CONNECTIONS
+
+/* R connection backed by a filestream, with a read-ahead or write-behind buffer.
+ * R does not expect errors from the callbacks: failures are reported with a
+ * warning and a short read or write count, like other connections do. */
+
+#define CONN_BUFSIZE (1024 * 1024)
+
+typedef struct {
+  SEXP ptr;
+  uint8_t * buf;
+  size_t pos;
+  size_t len;
+  int writing;
+  int saved;
+  int failed;
+} gridfs_conn;
+
+static filestream * conn_stream(Rconnection con){
+  return R_ExternalPtrAddr(((gridfs_conn *) con->private)->ptr);
+}
+
+static void conn_warning(Rconnection con, const char * message){
+  gridfs_conn * gc = con->private;
+  gc->failed = 1;
+  Rf_warning("gridfs connection '%s': %s", con->description, message);
+}
+
+static int conn_flush(Rconnection con){
+  gridfs_conn * gc = con->private;
+  bson_error_t err;
+  int ok = !gc->len || stream_write(conn_stream(con), gc->buf, gc->len, &err);
+  gc->len = 0;
+  if(!ok)
+    conn_warning(con, err.message);
+  return ok;
+}
+
+static size_t conn_write(const void * ptr, size_t size, size_t nitems, Rconnection con){
+  gridfs_conn * gc = con->private;
+  size_t total = size * nitems;
+  bson_error_t err;
+  if(gc->failed)
+    return 0;
+  if(gc->len + total > CONN_BUFSIZE && !conn_flush(con))
+    return 0;
+  if(total >= CONN_BUFSIZE){
+    if(!stream_write(conn_stream(con), ptr, total, &err)){
+      conn_warning(con, err.message);
+      return 0;
+    }
+  } else {
+    memcpy(gc->buf + gc->len, ptr, total);
+    gc->len += total;
+  }
+  return nitems;
+}
+
+static size_t conn_read(void * target, size_t size, size_t nitems, Rconnection con){
+  gridfs_conn * gc = con->private;
+  uint8_t * out = target;
+  size_t total = size * nitems;
+  size_t done = 0;
+  bson_error_t err;
+  while(done < total && !gc->failed){
+    if(gc->pos == gc->len){
+      /* Large reads bypass the buffer */
+      size_t want = total - done;
+      uint8_t * dest = want >= CONN_BUFSIZE ? out + done : gc->buf;
+      size_t max = want >= CONN_BUFSIZE ? want : CONN_BUFSIZE;
+      ssize_t len = stream_read(gc->ptr, conn_stream(con), dest, max, &err);
+      if(len < 0){
+        conn_warning(con, err.message);
+        break;
+      }
+      if(len == 0)
+        break;
+      if(dest != gc->buf){
+        done += len;
+        continue;
+      }
+      gc->pos = 0;
+      gc->len = len;
+    }
+    size_t n = BSON_MIN(total - done, gc->len - gc->pos);
+    memcpy(out + done, gc->buf + gc->pos, n);
+    gc->pos += n;
+    done += n;
+  }
+  return done / size;
+}
+
+static int conn_fgetc(Rconnection con){
+  unsigned char c;
+  return conn_read(&c, 1, 1, con) ? c : R_EOF;
+}
+
+/* Returning FALSE makes R raise its usual 'cannot open the connection' error */
+static Rboolean conn_open(Rconnection con){
+  gridfs_conn * gc = con->private;
+  int writing = con->mode[0] == 'w' || con->mode[0] == 'a';
+  if(writing != gc->writing){
+    Rf_warning("This gridfs connection can only be opened for %s", gc->writing ? "writing" : "reading");
+    return FALSE;
+  }
+  if(gc->saved){
+    Rf_warning("File has already been written");
+    return FALSE;
+  }
+  if(!writing && !mongoc_gridfs_file_seek(conn_stream(con)->file, 0, SEEK_SET)){
+    Rf_warning("Failed to rewind file");
+    return FALSE;
+  }
+  conn_stream(con)->pos = 0;
+  gc->pos = 0;
+  gc->len = 0;
+  gc->failed = 0;
+  con->text = strchr(con->mode, 'b') ? FALSE : TRUE;
+  con->canread = !writing;
+  con->canwrite = writing;
+  con->isopen = TRUE;
+  return TRUE;
+}
+
+/* A file that failed to write is not saved, so no partial file is stored */
+static void conn_close(Rconnection con){
+  gridfs_conn * gc = con->private;
+  con->isopen = FALSE;
+  if(gc->writing){
+    bson_error_t err;
+    gc->saved = 1;
+    if(gc->failed){
+      Rf_warning("gridfs connection '%s': file was not saved after a write error", con->description);
+    } else if(conn_flush(con) && !stream_save(gc->ptr, conn_stream(con), &err)){
+      conn_warning(con, err.message);
+    }
+  }
+}
+
+static void conn_destroy(Rconnection con){
+  gridfs_conn * gc = con->private;
+  R_ReleaseObject(gc->ptr);
+  free(gc->buf);
+  free(gc);
+}
+
+SEXP R_gridfs_connection(SEXP ptr, SEXP description, SEXP mode){
+  get_stream_ptr(ptr);
+  Rconnection con;
+  SEXP rc = PROTECT(R_new_custom_connection(CHAR(STRING_ELT(description, 0)), CHAR(STRING_ELT(mode, 0)), "gridfs", &con));
+  gridfs_conn * gc = calloc(1, sizeof(gridfs_conn));
+  if(gc == NULL || (gc->buf = malloc(CONN_BUFSIZE)) == NULL){
+    free(gc);
+    stop("Failed to allocate connection buffer");
+  }
+  gc->ptr = ptr;
+  gc->writing = con->mode[0] == 'w' || con->mode[0] == 'a';
+  R_PreserveObject(ptr);
+  con->private = gc;
+  con->isopen = FALSE;
+  con->incomplete = FALSE;
+  con->canseek = FALSE;
+  con->blocking = TRUE;
+  con->text = strchr(con->mode, 'b') ? FALSE : TRUE;
+  con->canread = !gc->writing;
+  con->canwrite = gc->writing;
+  con->open = conn_open;
+  con->close = conn_close;
+  con->destroy = conn_destroy;
+  con->read = conn_read;
+  con->write = conn_write;
+  con->fgetc = conn_fgetc;
+  con->fgetc_internal = conn_fgetc;
+  UNPROTECT(1);
+  return rc;
+}
+
+#else
+
+SEXP R_gridfs_connection(SEXP ptr, SEXP description, SEXP mode){
+  return R_NilValue;
+}
+
+#endif
@@ -1,6 +1,7 @@
 #include <R_ext/Rdynload.h>
 #include <mongolite.h>
 #include <Rversion.h>
+#include <common-thread-private.h>
 
 //default
 mongoc_log_level_t max_log_level = MONGOC_LOG_LEVEL_INFO;
@@ -11,9 +12,30 @@ SEXP R_mongo_log_level(SEXP level){
   return Rf_mkString(mongoc_log_level_str(max_log_level));
 }
 
-void mongolite_log_handler (mongoc_log_level_t event, const char *log_domain, const char *message, void *user_data) {
-  if(event > max_log_level)
-    return;
+/* Background threads (transfer, async, warmup and pool monitor workers) must not
+ * call the R API. Their messages are queued and emitted by the main thread on the
+ * next call into the package. */
+#define LOG_QUEUE_MAX 64
+
+typedef struct {
+  mongoc_log_level_t level;
+  char message[512];
+} queued_log;
+
+static queued_log log_queue[LOG_QUEUE_MAX];
+static int log_queued = 0;
+static int log_dropped = 0;
+static bson_mutex_t log_lock;
+
+#ifdef _WIN32
+static DWORD main_thread;
+#define is_main_thread() (GetCurrentThreadId() == main_thread)
+#else
+static pthread_t main_thread;
+#define is_main_thread() pthread_equal(pthread_self(), main_thread)
+#endif
+
+static void log_emit(mongoc_log_level_t event, const char *message){
   switch (event) {
   case MONGOC_LOG_LEVEL_ERROR: //0
   case MONGOC_LOG_LEVEL_CRITICAL: //1
@@ -31,9 +53,49 @@ void mongolite_log_handler (mongoc_log_level_t event, const char *log_domain, co
   }
 }
 
+/* Must only be called from the main thread */
+void log_flush(void){
+  queued_log copy[LOG_QUEUE_MAX];
+  bson_mutex_lock(&log_lock);
+  int n = log_queued;
+  int dropped = log_dropped;
+  memcpy(copy, log_queue, n * sizeof(queued_log));
+  log_queued = 0;
+  log_dropped = 0;
+  bson_mutex_unlock(&log_lock);
+  for(int i = 0; i < n; i++)
+    log_emit(copy[i].level, copy[i].message);
+  if(dropped)
+    Rf_warningcall_immediate(R_NilValue, "%d more driver messages from background threads were dropped", dropped);
+}
+
+void mongolite_log_handler (mongoc_log_level_t event, const char *log_domain, const char *message, void *user_data) {
+  if(event > max_log_level)
+    return;
+  if(is_main_thread()){
+    log_emit(event, message);
+    return;
+  }
+  bson_mutex_lock(&log_lock);
+  if(log_queued < LOG_QUEUE_MAX){
+    log_queue[log_queued].level = event;
+    bson_strncpy(log_queue[log_queued].message, message, sizeof log_queue[log_queued].message);
+    log_queued++;
+  } else {
+    log_dropped++;
+  }
+  bson_mutex_unlock(&log_lock);
+}
+
 void R_init_mongolite(DllInfo *info) {
   static mongoc_log_func_t logfun = mongolite_log_handler;
   char *r_version = "";
+#ifdef _WIN32
+  main_thread = GetCurrentThreadId();
+#else
+  main_thread = pthread_self();
+#endif
+  bson_mutex_init(&log_lock);
   mongoc_init();
 
   SEXP agent = Rf_GetOption1(Rf_install("HTTPUserAgent"));
@@ -44,11 +106,16 @@ void R_init_mongolite(DllInfo *info) {
   }
   mongoc_handshake_data_append ("mongolite", "", r_version);
   mongoc_log_set_handler(logfun, NULL);
+  monitor_init();
+  pool_init();
+  async_init();
   R_registerRoutines(info, NULL, NULL, NULL, NULL);
   R_useDynamicSymbols(info, TRUE);
   bson_free (r_version);
 }
 
 void R_unload_mongolite(DllInfo *info) {
+  async_cleanup();
+  monitor_cleanup();
   mongoc_cleanup();
 }
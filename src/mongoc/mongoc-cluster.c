@@ -244,6 +244,9 @@ _compression_level_from_uri(int32_t compressor_id, const mongoc_uri_t *uri)
    if (compressor_id == MONGOC_COMPRESSOR_ZLIB_ID) {
       return mongoc_uri_get_option_as_int32(uri, MONGOC_URI_ZLIBCOMPRESSIONLEVEL, -1);
    }
+   if (compressor_id == MONGOC_COMPRESSOR_ZSTD_ID) {
+      return mongoc_uri_get_option_as_int32(uri, MONGOC_URI_ZSTDCOMPRESSIONLEVEL, 0);
+   }
 
    return -1;
 }
@@ -3463,6 +3466,9 @@ mcd_rpc_message_compress(mcd_rpc_message *rpc,
       mcd_rpc_message_set_length(rpc, message_len);
    }
 
+   mongoc_counter_compression_egress_in_add((int64_t)uncompressed_size);
+   mongoc_counter_compression_egress_out_add((int64_t)compressed_size);
+
    *data = compressed_message;
    *data_len = compressed_size;
    compressed_message = NULL;
@@ -3538,6 +3544,9 @@ mcd_rpc_message_decompress(mcd_rpc_message *rpc, void **data, size_t *data_len,
       return false;
    }
 
+   mongoc_counter_compression_ingress_in_add((int64_t)mcd_rpc_op_compressed_get_compressed_message_length(rpc));
+   mongoc_counter_compression_ingress_out_add((int64_t)actual_uncompressed_size);
+
    *data_len = original_message_length;
    *data = ptr; // Ownership transfer.
 
@@ -274,7 +274,7 @@ mongoc_compress(int32_t compressor_id,
 #ifdef MONGOC_ENABLE_COMPRESSION_ZSTD
       int ok;
 
-      ok = ZSTD_compress((void *)compressed, *compressed_len, (const void *)uncompressed, uncompressed_len, 0);
+      ok = ZSTD_compress((void *)compressed, *compressed_len, (const void *)uncompressed, uncompressed_len, compression_level);
 
       if (!ZSTD_isError(ok)) {
          *compressed_len = ok;
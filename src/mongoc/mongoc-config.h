@@ -188,6 +188,12 @@
 #  undef MONGOC_ENABLE_COMPRESSION_ZLIB
 #endif
 
+/*
+ * mongolite: enable the driver counters, these are read from R with
+ * mongo_counters(). See mongoc-counters.c for the shared memory export.
+ */
+#define MONGOC_ENABLE_SHM_COUNTERS 1
+
 /*
  * Set if struct sockaddr_storage has __ss_family (instead of ss_family)
  */
@@ -80,6 +80,9 @@ static void *gCounterFallback = NULL;
 #include <mongoc/mongoc-counters.defs>
 #undef COUNTER
 
+/* mongolite: counters are read in-process, they are only exported over shared
+ * memory if MONGOC_EXPORT_SHM_COUNTERS is defined, which needs -lrt on old glibc */
+#if defined(BSON_OS_UNIX) && defined(MONGOC_EXPORT_SHM_COUNTERS)
 /**
  * mongoc_counters_use_shm:
  *
@@ -92,6 +95,7 @@ mongoc_counters_use_shm(void)
 {
    return !getenv("MONGOC_DISABLE_SHM");
 }
+#endif
 
 /**
  * mongoc_counters_calc_size:
@@ -141,7 +145,7 @@ _mongoc_counters_cleanup(void)
    if (gCounterFallback) {
       bson_free(gCounterFallback);
       gCounterFallback = NULL;
-#if defined(BSON_OS_UNIX) && defined(MONGOC_ENABLE_SHM_COUNTERS)
+#if defined(BSON_OS_UNIX) && defined(MONGOC_ENABLE_SHM_COUNTERS) && defined(MONGOC_EXPORT_SHM_COUNTERS)
    } else {
       char name[32];
       int pid;
@@ -170,7 +174,7 @@ _mongoc_counters_cleanup(void)
 static void *
 mongoc_counters_alloc(size_t size)
 {
-#if defined(BSON_OS_UNIX) && defined(MONGOC_ENABLE_SHM_COUNTERS)
+#if defined(BSON_OS_UNIX) && defined(MONGOC_ENABLE_SHM_COUNTERS) && defined(MONGOC_EXPORT_SHM_COUNTERS)
    void *mem;
    char name[32];
    int pid;
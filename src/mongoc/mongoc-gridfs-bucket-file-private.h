@@ -34,6 +34,8 @@ typedef struct {
    char *filename;
    bson_value_t *file_id;
    bson_t *metadata;
+   /* mongolite: optional contentType of the files document */
+   char *content_type;
    int32_t chunk_size;
    int64_t length;
 
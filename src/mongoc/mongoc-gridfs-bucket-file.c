@@ -459,6 +459,9 @@ _mongoc_gridfs_bucket_file_save(mongoc_gridfs_bucket_file_t *file)
    BSON_APPEND_INT32(&new_doc, "chunkSize", file->chunk_size);
    BSON_APPEND_DATE_TIME(&new_doc, "uploadDate", _mongoc_get_real_time_ms());
    BSON_APPEND_UTF8(&new_doc, "filename", file->filename);
+   if (file->content_type) {
+      BSON_APPEND_UTF8(&new_doc, "contentType", file->content_type);
+   }
    if (file->metadata) {
       BSON_APPEND_DOCUMENT(&new_doc, "metadata", file->metadata);
    }
@@ -479,6 +482,7 @@ _mongoc_gridfs_bucket_file_destroy(mongoc_gridfs_bucket_file_t *file)
       mongoc_cursor_destroy(file->cursor);
       bson_free(file->buffer);
       bson_free(file->filename);
+      bson_free(file->content_type);
       bson_free(file);
    }
 }
@@ -183,6 +183,13 @@ mongoc_gridfs_bucket_open_upload_stream_with_id(mongoc_gridfs_bucket_t *bucket,
    file->bucket = bucket;
    file->chunk_size = gridfs_opts.chunkSizeBytes;
    file->metadata = bson_copy(&gridfs_opts.metadata);
+   /* mongolite: the deprecated contentType field is taken from the upload opts */
+   {
+      bson_iter_t iter;
+      if (bson_iter_init_find(&iter, &gridfs_opts.extra, "contentType") && BSON_ITER_HOLDS_UTF8(&iter)) {
+         file->content_type = bson_strdup(bson_iter_utf8(&iter, NULL));
+      }
+   }
    BSON_ASSERT(gridfs_opts.chunkSizeBytes > 0); // Validated in _mongoc_gridfs_bucket_opts_parse.
    file->buffer = bson_malloc((size_t)gridfs_opts.chunkSizeBytes);
    file->in_buffer = 0;
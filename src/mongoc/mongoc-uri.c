@@ -692,6 +692,7 @@ mongoc_uri_option_is_int32(const char *key)
           !strcasecmp(key, MONGOC_URI_LOCALTHRESHOLDMS) || !strcasecmp(key, MONGOC_URI_MAXPOOLSIZE) ||
           !strcasecmp(key, MONGOC_URI_MAXSTALENESSSECONDS) || !strcasecmp(key, MONGOC_URI_WAITQUEUETIMEOUTMS) ||
           !strcasecmp(key, MONGOC_URI_ZLIBCOMPRESSIONLEVEL) || !strcasecmp(key, MONGOC_URI_SRVMAXHOSTS) ||
+          !strcasecmp(key, MONGOC_URI_ZSTDCOMPRESSIONLEVEL) ||
           !strcasecmp(key, MONGOC_URI_MAXADAPTIVERETRIES);
 }
 
@@ -3013,6 +3014,12 @@ _mongoc_uri_set_option_as_int32_with_error(mongoc_uri_t *uri,
       return false;
    }
 
+   /* zstd levels are from 1 through 22, 0 means the zstd default (3) */
+   if (!bson_strcasecmp(option, MONGOC_URI_ZSTDCOMPRESSIONLEVEL) && (value < 0 || value > 22)) {
+      MONGOC_URI_ERROR(error, "Invalid \"%s\" of %d: must be between 0 and 22", option_orig, value);
+      return false;
+   }
+
    if ((options = mongoc_uri_get_options(uri)) && bson_iter_init_find_case(&iter, options, option)) {
       if (BSON_ITER_HOLDS_INT32(&iter)) {
          bson_iter_overwrite_int32(&iter, value);
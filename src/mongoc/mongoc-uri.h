@@ -77,6 +77,8 @@
 #define MONGOC_URI_WAITQUEUETIMEOUTMS "waitqueuetimeoutms"
 #define MONGOC_URI_WTIMEOUTMS "wtimeoutms"
 #define MONGOC_URI_ZLIBCOMPRESSIONLEVEL "zlibcompressionlevel"
+/* mongolite: level for zstd wire compression, not part of the uri spec */
+#define MONGOC_URI_ZSTDCOMPRESSIONLEVEL "zstdcompressionlevel"
 
 /* Deprecated in MongoDB 4.2, use "tls" variants instead. */
 #define MONGOC_URI_SSL "ssl"
@@ -20,7 +20,63 @@ SEXP col2r(mongoc_collection_t *col, SEXP prot);
 SEXP cursor2r(mongoc_cursor_t* c, SEXP prot);
 SEXP client2r(mongoc_client_t *client);
 SEXP gridfs2r(mongoc_gridfs_t *fs, SEXP prot);
+void log_flush(void);
 void mongolite_log_handler (mongoc_log_level_t log_level, const char *log_domain, const char *message, void *user_data);
 SEXP ConvertObject(bson_iter_t* iter, bson_iter_t* counter);
+SEXP ConvertAtomic(bson_iter_t* iter, bson_iter_t* counter);
+SEXP ConvertValue(bson_iter_t* iter);
+SEXPTYPE atomic_type(bson_iter_t* iter);
+SEXPTYPE atomic_common(SEXPTYPE type, SEXPTYPE eltype);
+void set_atomic(SEXP ret, R_xlen_t i, bson_iter_t* iter);
+void set_posixct(SEXP x);
 SEXP bson2list(const bson_t *b);
 SEXP bson_to_str(const bson_t * b);
+SEXP create_outlist(mongoc_gridfs_file_t * file);
+mongoc_gridfs_file_t * find_single_file(SEXP ptr_fs, SEXP name);
+mongoc_client_pool_t * client_pool_from_client(mongoc_client_t *client, int size);
+mongoc_client_pool_t * client_get_pool(SEXP ptr_client);
+mongoc_client_pool_t * client_async_pool(SEXP ptr_client);
+void client_reset_async_pool(SEXP ptr_client);
+int client_pool_available(SEXP ptr_client);
+typedef struct pool_spec pool_spec;
+pool_spec * pool_spec_new(mongoc_client_t *client);
+mongoc_client_pool_t * pool_spec_create(const pool_spec *spec, int size);
+void pool_spec_free(pool_spec *spec);
+SEXP pooled_client2r(mongoc_client_pool_t *pool);
+void pool_init(void);
+void pool_retain(mongoc_client_pool_t *pool);
+void pool_release(mongoc_client_pool_t *pool);
+mongoc_client_t * pool_pop(mongoc_client_pool_t *pool);
+void pool_push(mongoc_client_pool_t *pool, mongoc_client_t *client);
+void client_set_pid(SEXP ptr_client);
+void client_check_fork(SEXP ptr);
+mongoc_read_prefs_t * r2readprefs(SEXP prefs);
+void monitor_init(void);
+void monitor_cleanup(void);
+void monitor_client(mongoc_client_t *client);
+void monitor_pool(mongoc_client_pool_t *pool);
+void async_init(void);
+void async_cleanup(void);
+void slowlog_init(void);
+void slowlog_cleanup(void);
+bool slowlog_active(void);
+void slowlog_started(const mongoc_apm_command_started_t *event);
+void slowlog_finished(const mongoc_host_list_t *host, int64_t connection_id, int64_t request_id,
+                      int64_t duration_us, const bson_t *reply, const char *error);
+void * sha256_new(void);
+void sha256_update(void *ctx, const void *buf, size_t len);
+void sha256_final(void *ctx, char hex[65]);
+void dedup_prepare(SEXP ptr_fs);
+bool dedup_link(mongoc_gridfs_t *fs, const bson_value_t *id, const char *hex, bson_error_t *err);
+bool dedup_remove(mongoc_gridfs_t *fs, mongoc_gridfs_file_t *file, bson_error_t *err);
+const bson_value_t * file_content_id(mongoc_gridfs_file_t *file);
+SEXP R_mongo_gridfs_download_parallel(SEXP ptr_fs, SEXP name, SEXP path, SEXP workers);
+SEXP bucket_upload(SEXP ptr_fs, SEXP name, SEXP path, SEXP content_type, SEXP meta_ptr, SEXP chunk_size, const char *sha256);
+
+#define CODEC_NONE 0
+#define CODEC_ZLIB 1
+int codec_from_name(const char *name);
+const char * codec_name(int codec);
+int file_codec(mongoc_gridfs_file_t *file);
+uint8_t * chunk_compress(int codec, const uint8_t *data, size_t len, size_t *outlen);
+const uint8_t * chunk_payload(int codec, const uint8_t *data, uint32_t *len, uint8_t *scratch, uint32_t max);
@@ -0,0 +1,399 @@
+#include <mongolite.h>
+#include <common-atomic-private.h>
+#include <common-thread-private.h>
+#include <mongoc/mongoc-client-private.h>
+#include <mongoc/mongoc-topology-private.h>
+#include <mongoc/mongoc-util-private.h>
+
+/* Command monitoring. APM callbacks are only installed on clients while monitoring
+ * or the slow log is enabled: with a started callback set, the driver copies every
+ * command including its document payload to build the event, which is a real cost
+ * for large inserts. The callbacks do nothing once both are turned off again. Events are written by any thread into a ring buffer
+ * without locks: each writer claims a ticket and marks its slot with a sequence
+ * number before and after writing, so the reader can skip slots that are being
+ * overwritten. Latencies are aggregated per command into log-linear histograms,
+ * R only sees the events when it drains the buffer. */
+
+#define RING_SIZE 4096
+#define HIST_COMMANDS 64
+#define HIST_BUCKETS 160
+
+enum {EVENT_STARTED = 1, EVENT_SUCCEEDED, EVENT_FAILED};
+
+typedef struct {
+  int64_t seq;
+  int64_t time_us;
+  int64_t duration_us;
+  int64_t request_id;
+  int64_t operation_id;
+  int32_t reply_size;
+  int32_t type;
+  char command[32];
+  char database[64];
+  char server[64];
+  char error[96];
+} monitor_event;
+
+typedef struct {
+  char command[32];
+  int64_t failed;
+  int64_t total_us;
+  int64_t max_us;
+  int64_t buckets[HIST_BUCKETS];
+} histogram;
+
+static int32_t monitor_enabled = 0;
+static monitor_event ring[RING_SIZE];
+static int64_t ring_head = 0;
+static int64_t ring_tail = 0;
+static int64_t ring_dropped = 0;
+static histogram histograms[HIST_COMMANDS];
+static int64_t n_histograms = 0;
+static bson_mutex_t histogram_lock;
+static mongoc_apm_callbacks_t *callbacks = NULL;
+
+/* Two significant bits per power of two: values 0-3 map to themselves, larger
+ * values v in [2^e, 2^(e+1)) map to one of four buckets of that octave */
+static int bucket_index(int64_t us){
+  if(us < 4)
+    return us < 0 ? 0 : (int) us;
+  int e = 2;
+  while(e < 62 && us >> (e + 1))
+    e++;
+  int i = (e - 1) * 4 + (int) ((us >> (e - 2)) & 3);
+  return BSON_MIN(i, HIST_BUCKETS - 1);
+}
+
+static int64_t bucket_upper(int i){
+  if(i < 4)
+    return i;
+  int e = i / 4 + 1;
+  return ((int64_t) (4 + i % 4) << (e - 2)) + ((int64_t) 1 << (e - 2)) - 1;
+}
+
+/* The last slot collects commands once the table is full */
+static histogram * find_histogram(const char *command){
+  int64_t n = mcommon_atomic_int64_fetch(&n_histograms, mcommon_memory_order_acquire);
+  for(int64_t i = 0; i < n; i++){
+    if(!strcmp(histograms[i].command, command))
+      return &histograms[i];
+  }
+  bson_mutex_lock(&histogram_lock);
+  n = mcommon_atomic_int64_fetch(&n_histograms, mcommon_memory_order_acquire);
+  histogram *h = NULL;
+  for(int64_t i = 0; i < n && !h; i++){
+    if(!strcmp(histograms[i].command, command))
+      h = &histograms[i];
+  }
+  if(!h && n == HIST_COMMANDS){
+    h = &histograms[HIST_COMMANDS - 1];
+  } else if(!h){
+    h = &histograms[n];
+    bson_strncpy(h->command, n < HIST_COMMANDS - 1 ? command : "(other)", sizeof h->command);
+    mcommon_atomic_int64_fetch_add(&n_histograms, 1, mcommon_memory_order_release);
+  }
+  bson_mutex_unlock(&histogram_lock);
+  return h;
+}
+
+static void record_latency(const char *command, int64_t us, bool failed){
+  histogram *h = find_histogram(command);
+  mcommon_atomic_int64_fetch_add(&h->total_us, us, mcommon_memory_order_relaxed);
+  mcommon_atomic_int64_fetch_add(&h->buckets[bucket_index(us)], 1, mcommon_memory_order_relaxed);
+  if(failed)
+    mcommon_atomic_int64_fetch_add(&h->failed, 1, mcommon_memory_order_relaxed);
+  int64_t max = mcommon_atomic_int64_fetch(&h->max_us, mcommon_memory_order_relaxed);
+  while(us > max){
+    int64_t prev = mcommon_atomic_int64_compare_exchange_weak(&h->max_us, max, us, mcommon_memory_order_relaxed);
+    if(prev == max)
+      break;
+    max = prev;
+  }
+}
+
+static monitor_event * ring_claim(int64_t *ticket){
+  *ticket = mcommon_atomic_int64_fetch_add(&ring_head, 1, mcommon_memory_order_seq_cst);
+  monitor_event *ev = &ring[*ticket % RING_SIZE];
+  mcommon_atomic_int64_exchange(&ev->seq, 2 * *ticket + 1, mcommon_memory_order_seq_cst);
+  ev->duration_us = 0;
+  ev->reply_size = 0;
+  ev->error[0] = '\0';
+  ev->time_us = bson_get_monotonic_time();
+  return ev;
+}
+
+static void ring_publish(monitor_event *ev, int64_t ticket){
+  mcommon_atomic_thread_fence();
+  mcommon_atomic_int64_exchange(&ev->seq, 2 * ticket + 2, mcommon_memory_order_seq_cst);
+}
+
+static void set_server(monitor_event *ev, const mongoc_host_list_t *host){
+  bson_strncpy(ev->server, host ? host->host_and_port : "", sizeof ev->server);
+}
+
+static void on_started(const mongoc_apm_command_started_t *event){
+  if(slowlog_active())
+    slowlog_started(event);
+  if(!mcommon_atomic_int32_fetch(&monitor_enabled, mcommon_memory_order_relaxed))
+    return;
+  int64_t ticket;
+  monitor_event *ev = ring_claim(&ticket);
+  ev->type = EVENT_STARTED;
+  ev->request_id = mongoc_apm_command_started_get_request_id(event);
+  ev->operation_id = mongoc_apm_command_started_get_operation_id(event);
+  bson_strncpy(ev->command, mongoc_apm_command_started_get_command_name(event), sizeof ev->command);
+  bson_strncpy(ev->database, mongoc_apm_command_started_get_database_name(event), sizeof ev->database);
+  set_server(ev, mongoc_apm_command_started_get_host(event));
+  ring_publish(ev, ticket);
+}
+
+static void on_succeeded(const mongoc_apm_command_succeeded_t *event){
+  int64_t duration = mongoc_apm_command_succeeded_get_duration(event);
+  if(slowlog_active())
+    slowlog_finished(mongoc_apm_command_succeeded_get_host(event),
+                     mongoc_apm_command_succeeded_get_server_connection_id_int64(event),
+                     mongoc_apm_command_succeeded_get_request_id(event), duration,
+                     mongoc_apm_command_succeeded_get_reply(event), NULL);
+  if(!mcommon_atomic_int32_fetch(&monitor_enabled, mcommon_memory_order_relaxed))
+    return;
+  const char *command = mongoc_apm_command_succeeded_get_command_name(event);
+  record_latency(command, duration, false);
+  int64_t ticket;
+  monitor_event *ev = ring_claim(&ticket);
+  ev->type = EVENT_SUCCEEDED;
+  ev->duration_us = duration;
+  ev->reply_size = mongoc_apm_command_succeeded_get_reply(event)->len;
+  ev->request_id = mongoc_apm_command_succeeded_get_request_id(event);
+  ev->operation_id = mongoc_apm_command_succeeded_get_operation_id(event);
+  bson_strncpy(ev->command, command, sizeof ev->command);
+  bson_strncpy(ev->database, mongoc_apm_command_succeeded_get_database_name(event), sizeof ev->database);
+  set_server(ev, mongoc_apm_command_succeeded_get_host(event));
+  ring_publish(ev, ticket);
+}
+
+static void on_failed(const mongoc_apm_command_failed_t *event){
+  int64_t duration = mongoc_apm_command_failed_get_duration(event);
+  bson_error_t err;
+  mongoc_apm_command_failed_get_error(event, &err);
+  if(slowlog_active())
+    slowlog_finished(mongoc_apm_command_failed_get_host(event),
+                     mongoc_apm_command_failed_get_server_connection_id_int64(event),
+                     mongoc_apm_command_failed_get_request_id(event), duration,
+                     mongoc_apm_command_failed_get_reply(event), err.message);
+  if(!mcommon_atomic_int32_fetch(&monitor_enabled, mcommon_memory_order_relaxed))
+    return;
+  const char *command = mongoc_apm_command_failed_get_command_name(event);
+  record_latency(command, duration, true);
+  int64_t ticket;
+  monitor_event *ev = ring_claim(&ticket);
+  ev->type = EVENT_FAILED;
+  ev->duration_us = duration;
+  ev->reply_size = mongoc_apm_command_failed_get_reply(event)->len;
+  ev->request_id = mongoc_apm_command_failed_get_request_id(event);
+  ev->operation_id = mongoc_apm_command_failed_get_operation_id(event);
+  bson_strncpy(ev->error, err.message, sizeof ev->error);
+  bson_strncpy(ev->command, command, sizeof ev->command);
+  bson_strncpy(ev->database, mongoc_apm_command_failed_get_database_name(event), sizeof ev->database);
+  set_server(ev, mongoc_apm_command_failed_get_host(event));
+  ring_publish(ev, ticket);
+}
+
+void monitor_init(void){
+  bson_mutex_init(&histogram_lock);
+  callbacks = mongoc_apm_callbacks_new();
+  mongoc_apm_set_command_started_cb(callbacks, on_started);
+  mongoc_apm_set_command_succeeded_cb(callbacks, on_succeeded);
+  mongoc_apm_set_command_failed_cb(callbacks, on_failed);
+  slowlog_init();
+}
+
+void monitor_cleanup(void){
+  slowlog_cleanup();
+  mongoc_apm_callbacks_destroy(callbacks);
+  callbacks = NULL;
+  bson_mutex_destroy(&histogram_lock);
+}
+
+static bool monitor_wanted(void){
+  return slowlog_active() || mcommon_atomic_int32_fetch(&monitor_enabled, mcommon_memory_order_relaxed);
+}
+
+void monitor_client(mongoc_client_t *client){
+  if(monitor_wanted())
+    mongoc_client_set_apm_callbacks(client, callbacks, NULL);
+}
+
+void monitor_pool(mongoc_client_pool_t *pool){
+  if(monitor_wanted())
+    mongoc_client_pool_set_apm_callbacks(pool, callbacks, NULL);
+}
+
+/* Called for clients that already exist when monitoring or the slow log is enabled.
+ * A single client gets the callbacks now, and drops the private pool of its async
+ * tasks which may have been created without them. The callbacks of a pool can only
+ * be set before its first pop, so a pooled client is left as it is. */
+SEXP R_mongo_client_monitor(SEXP ptr_client){
+  mongoc_client_t *client = r2client(ptr_client);
+  if(!monitor_wanted() || !client->topology->single_threaded)
+    return Rf_ScalarLogical(FALSE);
+  if(client->topology->log_and_monitor.apm_callbacks.started != on_started){
+    mongoc_client_set_apm_callbacks(client, callbacks, NULL);
+    client_reset_async_pool(ptr_client);
+  }
+  return Rf_ScalarLogical(TRUE);
+}
+
+SEXP R_mongo_monitor(SEXP enable){
+  if(Rf_length(enable))
+    mcommon_atomic_int32_exchange(&monitor_enabled, Rf_asLogical(enable) > 0, mcommon_memory_order_seq_cst);
+  return Rf_ScalarLogical(mcommon_atomic_int32_fetch(&monitor_enabled, mcommon_memory_order_seq_cst));
+}
+
+/* Copies the events that were published since the last drain */
+SEXP R_mongo_monitor_events(void){
+  int64_t head = mcommon_atomic_int64_fetch(&ring_head, mcommon_memory_order_seq_cst);
+  if(head - ring_tail > RING_SIZE){
+    ring_dropped += head - ring_tail - RING_SIZE;
+    ring_tail = head - RING_SIZE;
+  }
+  int64_t n = head - ring_tail;
+  monitor_event *events = bson_malloc(BSON_MAX(n, 1) * sizeof(monitor_event));
+  int64_t count = 0;
+  int64_t t = ring_tail;
+  for(; t < head; t++){
+    monitor_event *ev = &ring[t % RING_SIZE];
+    int64_t before = mcommon_atomic_int64_fetch(&ev->seq, mcommon_memory_order_seq_cst);
+    if(before < 2 * t + 2)
+      break; // still being written, retry on the next drain
+    memcpy(&events[count], ev, sizeof(monitor_event));
+    mcommon_atomic_thread_fence();
+    if(before != 2 * t + 2 || mcommon_atomic_int64_fetch(&ev->seq, mcommon_memory_order_seq_cst) != before){
+      ring_dropped++; // overwritten by a later event
+      continue;
+    }
+    count++;
+  }
+  ring_tail = t;
+
+  const char *types[] = {"", "started", "succeeded", "failed"};
+  SEXP time = PROTECT(Rf_allocVector(REALSXP, count));
+  SEXP type = PROTECT(Rf_allocVector(STRSXP, count));
+  SEXP command = PROTECT(Rf_allocVector(STRSXP, count));
+  SEXP database = PROTECT(Rf_allocVector(STRSXP, count));
+  SEXP server = PROTECT(Rf_allocVector(STRSXP, count));
+  SEXP request_id = PROTECT(Rf_allocVector(REALSXP, count));
+  SEXP operation_id = PROTECT(Rf_allocVector(REALSXP, count));
+  SEXP duration = PROTECT(Rf_allocVector(REALSXP, count));
+  SEXP reply_size = PROTECT(Rf_allocVector(INTSXP, count));
+  SEXP error = PROTECT(Rf_allocVector(STRSXP, count));
+
+  /* Event times are monotonic, convert to wall clock for R */
+  double offset = (bson_get_monotonic_time() - (double) _mongoc_get_real_time_ms() * 1000) / 1e6;
+  for(int64_t i = 0; i < count; i++){
+    monitor_event *ev = &events[i];
+    REAL(time)[i] = ev->time_us / 1e6 - offset;
+    SET_STRING_ELT(type, i, Rf_mkChar(types[ev->type]));
+    SET_STRING_ELT(command, i, Rf_mkChar(ev->command));
+    SET_STRING_ELT(database, i, Rf_mkChar(ev->database));
+    SET_STRING_ELT(server, i, Rf_mkChar(ev->server));
+    REAL(request_id)[i] = ev->request_id;
+    REAL(operation_id)[i] = ev->operation_id;
+    REAL(duration)[i] = ev->type == EVENT_STARTED ? NA_REAL : ev->duration_us / 1000.0;
+    INTEGER(reply_size)[i] = ev->type == EVENT_STARTED ? NA_INTEGER : ev->reply_size;
+    SET_STRING_ELT(error, i, ev->type == EVENT_FAILED ? Rf_mkChar(ev->error) : NA_STRING);
+  }
+  bson_free(events);
+  SEXP out = PROTECT(Rf_allocVector(VECSXP, 10));
+  SET_VECTOR_ELT(out, 0, time);
+  SET_VECTOR_ELT(out, 1, type);
+  SET_VECTOR_ELT(out, 2, command);
+  SET_VECTOR_ELT(out, 3, database);
+  SET_VECTOR_ELT(out, 4, server);
+  SET_VECTOR_ELT(out, 5, request_id);
+  SET_VECTOR_ELT(out, 6, operation_id);
+  SET_VECTOR_ELT(out, 7, duration);
+  SET_VECTOR_ELT(out, 8, reply_size);
+  SET_VECTOR_ELT(out, 9, error);
+  Rf_setAttrib(out, Rf_install("dropped"), Rf_ScalarReal(ring_dropped));
+  ring_dropped = 0;
+  UNPROTECT(11);
+  return out;
+}
+
+static double percentile(const int64_t *buckets, int64_t count, double p){
+  int64_t target = (int64_t) (p * count + 0.5);
+  int64_t seen = 0;
+  for(int i = 0; i < HIST_BUCKETS; i++){
+    seen += buckets[i];
+    if(seen >= BSON_MAX(target, 1))
+      return bucket_upper(i) / 1000.0;
+  }
+  return NA_REAL;
+}
+
+/* Summary per command with percentiles taken from the histogram buckets */
+SEXP R_mongo_monitor_latency(SEXP reset){
+  int64_t n = mcommon_atomic_int64_fetch(&n_histograms, mcommon_memory_order_acquire);
+  bool do_reset = Rf_asLogical(reset) > 0;
+  SEXP command = PROTECT(Rf_allocVector(STRSXP, n));
+  SEXP count = PROTECT(Rf_allocVector(REALSXP, n));
+  SEXP failed = PROTECT(Rf_allocVector(REALSXP, n));
+  SEXP mean = PROTECT(Rf_allocVector(REALSXP, n));
+  SEXP p50 = PROTECT(Rf_allocVector(REALSXP, n));
+  SEXP p90 = PROTECT(Rf_allocVector(REALSXP, n));
+  SEXP p99 = PROTECT(Rf_allocVector(REALSXP, n));
+  SEXP max = PROTECT(Rf_allocVector(REALSXP, n));
+  SEXP buckets = PROTECT(Rf_allocVector(VECSXP, n));
+  for(int64_t i = 0; i < n; i++){
+    histogram *h = &histograms[i];
+    int64_t snapshot[HIST_BUCKETS];
+    int64_t total = 0;
+    for(int b = 0; b < HIST_BUCKETS; b++){
+      snapshot[b] = do_reset ? mcommon_atomic_int64_exchange(&h->buckets[b], 0, mcommon_memory_order_relaxed) :
+        mcommon_atomic_int64_fetch(&h->buckets[b], mcommon_memory_order_relaxed);
+      total += snapshot[b];
+    }
+    int64_t sum = do_reset ? mcommon_atomic_int64_exchange(&h->total_us, 0, mcommon_memory_order_relaxed) :
+      mcommon_atomic_int64_fetch(&h->total_us, mcommon_memory_order_relaxed);
+    SET_STRING_ELT(command, i, Rf_mkChar(h->command));
+    REAL(count)[i] = total;
+    REAL(failed)[i] = do_reset ? mcommon_atomic_int64_exchange(&h->failed, 0, mcommon_memory_order_relaxed) :
+      mcommon_atomic_int64_fetch(&h->failed, mcommon_memory_order_relaxed);
+    REAL(mean)[i] = total ? sum / 1000.0 / total : NA_REAL;
+    REAL(p50)[i] = percentile(snapshot, total, 0.5);
+    REAL(p90)[i] = percentile(snapshot, total, 0.9);
+    REAL(p99)[i] = percentile(snapshot, total, 0.99);
+    int64_t max_us = do_reset ? mcommon_atomic_int64_exchange(&h->max_us, 0, mcommon_memory_order_relaxed) :
+      mcommon_atomic_int64_fetch(&h->max_us, mcommon_memory_order_relaxed);
+    REAL(max)[i] = total ? max_us / 1000.0 : NA_REAL;
+
+    /* Non-empty buckets as a named vector of counts by upper bound in ms */
+    int used = 0;
+    for(int b = 0; b < HIST_BUCKETS; b++)
+      used += snapshot[b] > 0;
+    SEXP hist = PROTECT(Rf_allocVector(REALSXP, used));
+    SEXP names = PROTECT(Rf_allocVector(STRSXP, used));
+    for(int b = 0, j = 0; b < HIST_BUCKETS; b++){
+      if(!snapshot[b]) continue;
+      char label[32];
+      bson_snprintf(label, sizeof label, "%g", bucket_upper(b) / 1000.0);
+      REAL(hist)[j] = snapshot[b];
+      SET_STRING_ELT(names, j++, Rf_mkChar(label));
+    }
+    Rf_setAttrib(hist, R_NamesSymbol, names);
+    SET_VECTOR_ELT(buckets, i, hist);
+    UNPROTECT(2);
+  }
+  SEXP out = PROTECT(Rf_allocVector(VECSXP, 9));
+  SET_VECTOR_ELT(out, 0, command);
+  SET_VECTOR_ELT(out, 1, count);
+  SET_VECTOR_ELT(out, 2, failed);
+  SET_VECTOR_ELT(out, 3, mean);
+  SET_VECTOR_ELT(out, 4, p50);
+  SET_VECTOR_ELT(out, 5, p90);
+  SET_VECTOR_ELT(out, 6, p99);
+  SET_VECTOR_ELT(out, 7, max);
+  SET_VECTOR_ELT(out, 8, buckets);
+  UNPROTECT(10);
+  return out;
+}
@@ -0,0 +1,240 @@
+#include <mongolite.h>
+#include <common-thread-private.h>
+#include <mongoc/mongoc-client-private.h>
+#include <mongoc/mongoc-ssl-private.h>
+
+static mongoc_client_pool_t * pool_new(const mongoc_uri_t *uri, const mongoc_ssl_opt_t *ssl_opts, int size){
+  mongoc_client_pool_t *pool = mongoc_client_pool_new(uri);
+  if(!pool)
+    return NULL;
+  mongoc_client_pool_max_size(pool, size);
+#ifdef MONGOC_ENABLE_SSL
+  if(ssl_opts)
+    mongoc_client_pool_set_ssl_opts(pool, ssl_opts);
+#endif
+  if(NULL == mongoc_uri_get_appname(uri))
+    mongoc_client_pool_set_appname(pool, "r/mongolite");
+  monitor_pool(pool);
+  return pool;
+}
+
+/* Creates a thread-safe pool with the same uri and ssl settings as an existing
+ * client. Used by operations that need multiple connections at once. */
+mongoc_client_pool_t * client_pool_from_client(mongoc_client_t *client, int size){
+#ifdef MONGOC_ENABLE_SSL
+  return pool_new(mongoc_client_get_uri(client), client->use_ssl ? &client->ssl_opts : NULL, size);
+#else
+  return pool_new(mongoc_client_get_uri(client), NULL, size);
+#endif
+}
+
+/* A copy of the settings of a client, from which a pool can be created later on
+ * another thread without touching the client itself. */
+struct pool_spec {
+  mongoc_uri_t *uri;
+  bool use_ssl;
+  mongoc_ssl_opt_t ssl_opts;
+};
+
+pool_spec * pool_spec_new(mongoc_client_t *client){
+  pool_spec *spec = bson_malloc0(sizeof(pool_spec));
+  spec->uri = mongoc_uri_copy(mongoc_client_get_uri(client));
+#ifdef MONGOC_ENABLE_SSL
+  if((spec->use_ssl = client->use_ssl))
+    _mongoc_ssl_opts_copy_to(&client->ssl_opts, &spec->ssl_opts, true);
+#endif
+  return spec;
+}
+
+mongoc_client_pool_t * pool_spec_create(const pool_spec *spec, int size){
+  return pool_new(spec->uri, spec->use_ssl ? &spec->ssl_opts : NULL, size);
+}
+
+void pool_spec_free(pool_spec *spec){
+  if(!spec) return;
+#ifdef MONGOC_ENABLE_SSL
+  if(spec->use_ssl)
+    _mongoc_ssl_opts_cleanup(&spec->ssl_opts, true);
+#endif
+  mongoc_uri_destroy(spec->uri);
+  bson_free(spec);
+}
+
+/* Background tasks that use a shared pool register as users, so that the pool
+ * outlives the R client object until the last of them is done. Clients that are
+ * popped by workers are counted, so that operations can tell how many more
+ * connections the pool can supply. */
+typedef struct pool_users {
+  mongoc_client_pool_t *pool;
+  int users;
+  int popped;
+  bool orphaned;
+  struct pool_users *next;
+} pool_users;
+
+static pool_users *pools = NULL;
+static bson_mutex_t pool_lock;
+
+void pool_init(void){
+  bson_mutex_init(&pool_lock);
+}
+
+static pool_users ** find_users(mongoc_client_pool_t *pool){
+  pool_users **p = &pools;
+  while(*p && (*p)->pool != pool)
+    p = &(*p)->next;
+  return p;
+}
+
+void pool_retain(mongoc_client_pool_t *pool){
+  bson_mutex_lock(&pool_lock);
+  pool_users **p = find_users(pool);
+  if(!*p){
+    *p = bson_malloc0(sizeof(pool_users));
+    (*p)->pool = pool;
+  }
+  (*p)->users++;
+  bson_mutex_unlock(&pool_lock);
+}
+
+/* May be called from any thread. The last user of an orphaned pool destroys it. */
+void pool_release(mongoc_client_pool_t *pool){
+  bool destroy = false;
+  bson_mutex_lock(&pool_lock);
+  pool_users **p = find_users(pool);
+  if(*p && --(*p)->users == 0){
+    pool_users *entry = *p;
+    destroy = entry->orphaned;
+    *p = entry->next;
+    bson_free(entry);
+  }
+  bson_mutex_unlock(&pool_lock);
+  if(destroy)
+    mongoc_client_pool_destroy(pool);
+}
+
+/* Pops a client from a shared pool on behalf of a worker. May block when the
+ * pool is exhausted, so the pool lock is not held while waiting. */
+mongoc_client_t * pool_pop(mongoc_client_pool_t *pool){
+  pool_retain(pool);
+  bson_mutex_lock(&pool_lock);
+  (*find_users(pool))->popped++;
+  bson_mutex_unlock(&pool_lock);
+  return mongoc_client_pool_pop(pool);
+}
+
+void pool_push(mongoc_client_pool_t *pool, mongoc_client_t *client){
+  mongoc_client_pool_push(pool, client);
+  bson_mutex_lock(&pool_lock);
+  (*find_users(pool))->popped--;
+  bson_mutex_unlock(&pool_lock);
+  pool_release(pool);
+}
+
+/* Called when the owner is gone: destroys the pool now, or leaves it to the last user */
+static void pool_orphan(mongoc_client_pool_t *pool){
+  bson_mutex_lock(&pool_lock);
+  pool_users *entry = *find_users(pool);
+  if(entry)
+    entry->orphaned = true;
+  bson_mutex_unlock(&pool_lock);
+  if(!entry)
+    mongoc_client_pool_destroy(pool);
+}
+
+/* Clients created from a uri with maxPoolSize are popped from a pool which is
+ * owned by the R client object. The pool is kept in the tag of the external
+ * pointer, and is destroyed by the same finalizer that returns the client, so
+ * the order in which finalizers run does not matter. Finalizers never wait for
+ * running background tasks. */
+static void fin_pooled_client(SEXP ptr){
+  client_check_fork(ptr);
+  mongoc_client_t *client = R_ExternalPtrAddr(ptr);
+  mongoc_client_pool_t *pool = R_ExternalPtrAddr(R_ExternalPtrTag(ptr));
+  if(!client || !pool) return;
+  mongoc_client_pool_push(pool, client);
+  pool_orphan(pool);
+  R_ClearExternalPtr(R_ExternalPtrTag(ptr));
+  R_SetExternalPtrTag(ptr, R_NilValue);
+  R_SetExternalPtrProtected(ptr, R_NilValue);
+  R_ClearExternalPtr(ptr);
+}
+
+SEXP pooled_client2r(mongoc_client_pool_t *pool){
+  mongoc_client_t *client = mongoc_client_pool_pop(pool);
+  SEXP tag = PROTECT(R_MakeExternalPtr(pool, R_NilValue, R_NilValue));
+  SEXP ptr = PROTECT(R_MakeExternalPtr(client, tag, R_NilValue));
+  R_RegisterCFinalizerEx(ptr, fin_pooled_client, 1);
+  Rf_setAttrib(ptr, R_ClassSymbol, Rf_mkString("mongo_client"));
+  client_set_pid(ptr);
+  UNPROTECT(2);
+  return ptr;
+}
+
+/* A single client caches a private pool for background tasks in its tag as well.
+ * The pointer of that pool is tagged with this symbol to tell the two apart. */
+static SEXP async_pool_symbol(void){
+  return Rf_install("async_pool");
+}
+
+/* Returns the shared pool of a pooled client or NULL for a single client */
+mongoc_client_pool_t * client_get_pool(SEXP ptr_client){
+  client_check_fork(ptr_client);
+  SEXP tag = R_ExternalPtrTag(ptr_client);
+  if(TYPEOF(tag) != EXTPTRSXP || R_ExternalPtrTag(tag) == async_pool_symbol())
+    return NULL;
+  return R_ExternalPtrAddr(tag);
+}
+
+/* Tasks that still use the pool keep it alive after the client is collected */
+static void fin_async_pool(SEXP ptr){
+  mongoc_client_pool_t *pool = R_ExternalPtrAddr(ptr);
+  if(!pool) return;
+  R_ClearExternalPtr(ptr);
+  pool_orphan(pool);
+}
+
+/* Drops the cached private pool of a single client, the next task creates a new one */
+void client_reset_async_pool(SEXP ptr_client){
+  SEXP tag = R_ExternalPtrTag(ptr_client);
+  if(TYPEOF(tag) == EXTPTRSXP && R_ExternalPtrTag(tag) == async_pool_symbol()){
+    fin_async_pool(tag);
+    R_SetExternalPtrTag(ptr_client, R_NilValue);
+  }
+}
+
+/* The pool on which background tasks of a client run: the shared pool of a pooled
+ * client, or a private pool which is created once for a single client. Connections
+ * are only opened when tasks need them, so it gets the default size of the driver.
+ * Users must pool_retain() it like a shared pool. */
+mongoc_client_pool_t * client_async_pool(SEXP ptr_client){
+  mongoc_client_pool_t *pool = client_get_pool(ptr_client);
+  SEXP tag = R_ExternalPtrTag(ptr_client);
+  if(pool || TYPEOF(tag) == EXTPTRSXP)
+    return pool ? pool : R_ExternalPtrAddr(tag);
+  if(!(pool = client_pool_from_client(r2client(ptr_client), 100)))
+    return NULL;
+  tag = PROTECT(R_MakeExternalPtr(pool, async_pool_symbol(), R_NilValue));
+  R_RegisterCFinalizerEx(tag, fin_async_pool, 1);
+  R_SetExternalPtrTag(ptr_client, tag);
+  UNPROTECT(1);
+  return pool;
+}
+
+/* Number of clients that can be popped besides the one held by R and those that
+ * are currently used by background workers */
+int client_pool_available(SEXP ptr_client){
+  mongoc_client_pool_t *pool = client_get_pool(ptr_client);
+  if(!pool)
+    return 0;
+  const mongoc_uri_t *uri = mongoc_client_get_uri(r2client(ptr_client));
+  bson_mutex_lock(&pool_lock);
+  pool_users *entry = *find_users(pool);
+  int popped = entry ? entry->popped : 0;
+  bson_mutex_unlock(&pool_lock);
+  return BSON_MAX(0, mongoc_uri_get_option_as_int32(uri, MONGOC_URI_MAXPOOLSIZE, 100) - 1 - popped);
+}
+
+SEXP R_mongo_client_pooled(SEXP ptr_client){
+  return Rf_ScalarLogical(client_get_pool(ptr_client) != NULL);
+}
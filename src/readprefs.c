@@ -0,0 +1,46 @@
+#include <mongolite.h>
+
+/* Read preferences are passed from R as list(mode, tags, max_staleness), where
+ * tags is a character vector with one JSON document per tag set. */
+
+static mongoc_read_mode_t read_mode(const char *mode){
+  if(!strcmp(mode, "primary"))
+    return MONGOC_READ_PRIMARY;
+  if(!strcmp(mode, "primaryPreferred"))
+    return MONGOC_READ_PRIMARY_PREFERRED;
+  if(!strcmp(mode, "secondary"))
+    return MONGOC_READ_SECONDARY;
+  if(!strcmp(mode, "secondaryPreferred"))
+    return MONGOC_READ_SECONDARY_PREFERRED;
+  if(!strcmp(mode, "nearest"))
+    return MONGOC_READ_NEAREST;
+  stopf("Invalid read preference mode: %s", mode);
+}
+
+/* Returns NULL for the default read preference. Caller must destroy the result. */
+mongoc_read_prefs_t * r2readprefs(SEXP prefs){
+  if(Rf_isNull(prefs))
+    return NULL;
+  if(TYPEOF(prefs) != VECSXP || Rf_length(prefs) != 3)
+    stop("Invalid read preference");
+  mongoc_read_prefs_t *rp = mongoc_read_prefs_new(read_mode(CHAR(STRING_ELT(VECTOR_ELT(prefs, 0), 0))));
+  SEXP tags = VECTOR_ELT(prefs, 1);
+  for(int i = 0; i < Rf_length(tags); i++){
+    bson_error_t err;
+    bson_t *tag = bson_new_from_json((const uint8_t*) Rf_translateCharUTF8(STRING_ELT(tags, i)), -1, &err);
+    if(!tag){
+      mongoc_read_prefs_destroy(rp);
+      stopf("Invalid tag set: %s", err.message);
+    }
+    mongoc_read_prefs_add_tag(rp, tag);
+    bson_destroy(tag);
+  }
+  SEXP staleness = VECTOR_ELT(prefs, 2);
+  if(Rf_length(staleness))
+    mongoc_read_prefs_set_max_staleness_seconds(rp, (int64_t) Rf_asReal(staleness));
+  if(!mongoc_read_prefs_is_valid(rp)){
+    mongoc_read_prefs_destroy(rp);
+    stop("Invalid read preference: tags and max_staleness require a mode other than primary");
+  }
+  return rp;
+}
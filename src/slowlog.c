@@ -0,0 +1,331 @@
+#include <mongolite.h>
+#include <common-atomic-private.h>
+#include <common-thread-private.h>
+#include <mongoc/mongoc-util-private.h>
+
+/* Slow operation log. When a threshold is set, the started callback stores a redacted
+ * copy of each command, which is picked up by the succeeded or failed callback if the
+ * command took longer than the threshold. Request ids are counted per client, so a
+ * command is identified by its server, connection id and request id. Slow operations are kept
+ * as bson documents until R collects them, and optionally appended to a log file as
+ * one json document per line. */
+
+#define PENDING_SLOTS 1024
+#define PENDING_PROBES 8
+#define SLOWLOG_MAX 1000
+#define REDACT_ARRAY_MAX 10
+#define REDACT_DEPTH_MAX 16
+
+typedef struct {
+  int64_t request_id;
+  int64_t connection_id;
+  char host[256];
+  int64_t start_ms;
+  char command[32];
+  char ns[128];
+  bson_t *cmd;
+} pending_command;
+
+static int64_t slowlog_threshold_us = -1;
+static pending_command pending[PENDING_SLOTS];
+static bson_t *entries[SLOWLOG_MAX];
+static int n_entries = 0;
+static int64_t n_dropped = 0;
+static FILE *logfile = NULL;
+static bson_mutex_t slowlog_lock;
+
+bool slowlog_active(void){
+  return mcommon_atomic_int64_fetch(&slowlog_threshold_us, mcommon_memory_order_relaxed) >= 0;
+}
+
+/* Nested values are replaced by "?", so filters and documents show their shape but not
+ * their content. Long arrays such as the documents of an insert are cut short. */
+static void redact(bson_iter_t *iter, bson_t *out, int depth, bool is_array){
+  int n = 0;
+  while(bson_iter_next(iter)){
+    const char *key = bson_iter_key(iter);
+    if(BSON_ITER_HOLDS_DOCUMENT(iter) || BSON_ITER_HOLDS_ARRAY(iter)){
+      bson_iter_t child;
+      bson_t sub;
+      if(depth >= REDACT_DEPTH_MAX || !bson_iter_recurse(iter, &child)){
+        BSON_APPEND_UTF8(out, key, "?");
+      } else if(BSON_ITER_HOLDS_ARRAY(iter)){
+        bson_append_array_unsafe_begin(out, key, -1, &sub);
+        redact(&child, &sub, depth + 1, true);
+        bson_append_array_end(out, &sub);
+      } else {
+        bson_append_document_begin(out, key, -1, &sub);
+        redact(&child, &sub, depth + 1, false);
+        bson_append_document_end(out, &sub);
+      }
+    } else {
+      BSON_APPEND_UTF8(out, key, "?");
+    }
+    if(is_array && ++n == REDACT_ARRAY_MAX && bson_iter_next(iter)){
+      BSON_APPEND_UTF8(out, bson_iter_key(iter), "...");
+      break;
+    }
+  }
+}
+
+/* Top-level scalars are the collection name and options such as limit and batchSize,
+ * which are kept. Session and cluster time fields are dropped. */
+static bson_t *redact_command(const bson_t *cmd){
+  bson_iter_t iter;
+  bson_t *out = bson_new();
+  if(!bson_iter_init(&iter, cmd))
+    return out;
+  while(bson_iter_next(&iter)){
+    const char *key = bson_iter_key(&iter);
+    if(!strcmp(key, "lsid") || !strcmp(key, "$clusterTime") || !strcmp(key, "$db"))
+      continue;
+    if(BSON_ITER_HOLDS_DOCUMENT(&iter) || BSON_ITER_HOLDS_ARRAY(&iter)){
+      bson_iter_t child;
+      bson_t sub;
+      bson_iter_recurse(&iter, &child);
+      if(BSON_ITER_HOLDS_ARRAY(&iter)){
+        bson_append_array_unsafe_begin(out, key, -1, &sub);
+        redact(&child, &sub, 1, true);
+        bson_append_array_end(out, &sub);
+      } else {
+        bson_append_document_begin(out, key, -1, &sub);
+        redact(&child, &sub, 1, false);
+        bson_append_document_end(out, &sub);
+      }
+    } else {
+      bson_append_iter(out, key, -1, &iter);
+    }
+  }
+  return out;
+}
+
+/* The collection is the value of the command name, except for getMore */
+static void command_namespace(const bson_t *cmd, const char *command, const char *db, char *ns, size_t len){
+  bson_iter_t iter;
+  const char *coll = NULL;
+  if(!strcmp(command, "getMore")){
+    if(bson_iter_init_find(&iter, cmd, "collection") && BSON_ITER_HOLDS_UTF8(&iter))
+      coll = bson_iter_utf8(&iter, NULL);
+  } else if(bson_iter_init(&iter, cmd) && bson_iter_next(&iter) && BSON_ITER_HOLDS_UTF8(&iter)){
+    coll = bson_iter_utf8(&iter, NULL);
+  }
+  if(coll)
+    bson_snprintf(ns, len, "%s.%s", db, coll);
+  else
+    bson_strncpy(ns, db, len);
+}
+
+/* Number of documents in a cursor batch, or affected by a write command */
+static int64_t reply_ndocs(const bson_t *reply){
+  bson_iter_t iter, batch;
+  if(bson_iter_init_find(&iter, reply, "cursor") && BSON_ITER_HOLDS_DOCUMENT(&iter) && bson_iter_recurse(&iter, &batch)){
+    while(bson_iter_next(&batch)){
+      const char *key = bson_iter_key(&batch);
+      if(BSON_ITER_HOLDS_ARRAY(&batch) && (!strcmp(key, "firstBatch") || !strcmp(key, "nextBatch"))){
+        bson_iter_t docs;
+        int64_t n = 0;
+        bson_iter_recurse(&batch, &docs);
+        while(bson_iter_next(&docs))
+          n++;
+        return n;
+      }
+    }
+  }
+  if(bson_iter_init_find(&iter, reply, "n") && BSON_ITER_HOLDS_NUMBER(&iter))
+    return bson_iter_as_int64(&iter);
+  return -1;
+}
+
+static const char *host_name(const mongoc_host_list_t *host){
+  return host ? host->host_and_port : "";
+}
+
+static uint64_t pending_hash(const char *host, int64_t connection_id, int64_t request_id){
+  uint64_t h = 14695981039346656037ULL;
+  for(const char *c = host; *c; c++)
+    h = (h ^ (uint8_t) *c) * 1099511628211ULL;
+  h = (h ^ (uint64_t) connection_id) * 1099511628211ULL;
+  h = (h ^ (uint64_t) request_id) * 1099511628211ULL;
+  return h;
+}
+
+static bool pending_match(pending_command *slot, const char *host, int64_t connection_id, int64_t request_id){
+  return slot->cmd && slot->request_id == request_id && slot->connection_id == connection_id &&
+    !strcmp(slot->host, host);
+}
+
+void slowlog_started(const mongoc_apm_command_started_t *event){
+  const bson_t *cmd = mongoc_apm_command_started_get_command(event);
+  const char *command = mongoc_apm_command_started_get_command_name(event);
+  const char *host = host_name(mongoc_apm_command_started_get_host(event));
+  int64_t connection_id = mongoc_apm_command_started_get_server_connection_id_int64(event);
+  int64_t request_id = mongoc_apm_command_started_get_request_id(event);
+  bson_t *redacted = redact_command(cmd);
+  char ns[128];
+  command_namespace(cmd, command, mongoc_apm_command_started_get_database_name(event), ns, sizeof ns);
+
+  /* Probe for a free slot, if all are taken the oldest command is likely lost */
+  bson_mutex_lock(&slowlog_lock);
+  uint64_t h = pending_hash(host, connection_id, request_id);
+  pending_command *slot = &pending[h % PENDING_SLOTS];
+  for(int i = 0; i < PENDING_PROBES; i++){
+    pending_command *probe = &pending[(h + i) % PENDING_SLOTS];
+    if(!probe->cmd){
+      slot = probe;
+      break;
+    }
+  }
+  bson_t *old = slot->cmd;
+  slot->request_id = request_id;
+  slot->connection_id = connection_id;
+  bson_strncpy(slot->host, host, sizeof slot->host);
+  slot->start_ms = _mongoc_get_real_time_ms();
+  slot->cmd = redacted;
+  bson_strncpy(slot->command, command, sizeof slot->command);
+  bson_strncpy(slot->ns, ns, sizeof slot->ns);
+  bson_mutex_unlock(&slowlog_lock);
+  bson_destroy(old);
+}
+
+void slowlog_finished(const mongoc_host_list_t *host_list, int64_t connection_id, int64_t request_id,
+                      int64_t duration_us, const bson_t *reply, const char *error){
+  int64_t threshold = mcommon_atomic_int64_fetch(&slowlog_threshold_us, mcommon_memory_order_relaxed);
+  const char *host = host_name(host_list);
+  bson_t *cmd = NULL;
+  bson_t *entry = NULL;
+  bson_mutex_lock(&slowlog_lock);
+  uint64_t h = pending_hash(host, connection_id, request_id);
+  pending_command *slot = NULL;
+  for(int i = 0; i < PENDING_PROBES && !slot; i++){
+    if(pending_match(&pending[(h + i) % PENDING_SLOTS], host, connection_id, request_id))
+      slot = &pending[(h + i) % PENDING_SLOTS];
+  }
+  if(slot){
+    cmd = slot->cmd;
+    slot->cmd = NULL;
+    if(threshold >= 0 && duration_us >= threshold){
+      int64_t ndocs = reply_ndocs(reply);
+      entry = BCON_NEW("time", BCON_DATE_TIME(slot->start_ms), "ns", BCON_UTF8(slot->ns),
+                       "command", BCON_UTF8(slot->command), "duration", BCON_DOUBLE(duration_us / 1000.0));
+      if(ndocs >= 0)
+        BSON_APPEND_INT64(entry, "ndocs", ndocs);
+      if(error)
+        BSON_APPEND_UTF8(entry, "error", error);
+      BSON_APPEND_DOCUMENT(entry, "cmd", cmd);
+      if(logfile){
+        char *json = bson_as_relaxed_extended_json(entry, NULL);
+        fprintf(logfile, "%s\n", json);
+        fflush(logfile);
+        bson_free(json);
+      }
+      if(n_entries < SLOWLOG_MAX){
+        entries[n_entries++] = entry;
+        entry = NULL;
+      } else {
+        n_dropped++;
+      }
+    }
+  }
+  bson_mutex_unlock(&slowlog_lock);
+  bson_destroy(cmd);
+  bson_destroy(entry);
+}
+
+static void slowlog_clear(void){
+  for(int i = 0; i < PENDING_SLOTS; i++){
+    bson_destroy(pending[i].cmd);
+    pending[i].cmd = NULL;
+  }
+  for(int i = 0; i < n_entries; i++)
+    bson_destroy(entries[i]);
+  n_entries = 0;
+  n_dropped = 0;
+  if(logfile)
+    fclose(logfile);
+  logfile = NULL;
+}
+
+void slowlog_init(void){
+  bson_mutex_init(&slowlog_lock);
+}
+
+void slowlog_cleanup(void){
+  mcommon_atomic_int64_exchange(&slowlog_threshold_us, -1, mcommon_memory_order_seq_cst);
+  slowlog_clear();
+  bson_mutex_destroy(&slowlog_lock);
+}
+
+/* Threshold in ms, or NULL to disable. Also closes a previous log file. */
+SEXP R_mongo_slowlog(SEXP threshold, SEXP file){
+  FILE *fp = NULL;
+  if(Rf_length(file) && !(fp = fopen(CHAR(STRING_ELT(file, 0)), "a")))
+    stopf("Failed to open log file %s", CHAR(STRING_ELT(file, 0)));
+  int64_t us = Rf_length(threshold) ? (int64_t) (Rf_asReal(threshold) * 1000) : -1;
+  bson_mutex_lock(&slowlog_lock);
+  mcommon_atomic_int64_exchange(&slowlog_threshold_us, us, mcommon_memory_order_seq_cst);
+  if(logfile)
+    fclose(logfile);
+  logfile = fp;
+  if(us < 0){
+    for(int i = 0; i < PENDING_SLOTS; i++){
+      bson_destroy(pending[i].cmd);
+      pending[i].cmd = NULL;
+    }
+  }
+  bson_mutex_unlock(&slowlog_lock);
+  return Rf_ScalarReal(us < 0 ? NA_REAL : us / 1000.0);
+}
+
+/* Takes the entries out of the buffer and converts them to columns */
+SEXP R_mongo_slowlog_entries(void){
+  bson_mutex_lock(&slowlog_lock);
+  int n = n_entries;
+  int64_t dropped = n_dropped;
+  bson_t **docs = bson_malloc(BSON_MAX(n, 1) * sizeof(bson_t*));
+  memcpy(docs, entries, n * sizeof(bson_t*));
+  n_entries = 0;
+  n_dropped = 0;
+  bson_mutex_unlock(&slowlog_lock);
+
+  SEXP time = PROTECT(Rf_allocVector(REALSXP, n));
+  SEXP ns = PROTECT(Rf_allocVector(STRSXP, n));
+  SEXP command = PROTECT(Rf_allocVector(STRSXP, n));
+  SEXP duration = PROTECT(Rf_allocVector(REALSXP, n));
+  SEXP ndocs = PROTECT(Rf_allocVector(REALSXP, n));
+  SEXP error = PROTECT(Rf_allocVector(STRSXP, n));
+  SEXP cmd = PROTECT(Rf_allocVector(STRSXP, n));
+  for(int i = 0; i < n; i++){
+    bson_iter_t iter;
+    REAL(time)[i] = bson_iter_init_find(&iter, docs[i], "time") ? bson_iter_date_time(&iter) / 1000.0 : NA_REAL;
+    SET_STRING_ELT(ns, i, bson_iter_init_find(&iter, docs[i], "ns") ? Rf_mkCharCE(bson_iter_utf8(&iter, NULL), CE_UTF8) : NA_STRING);
+    SET_STRING_ELT(command, i, bson_iter_init_find(&iter, docs[i], "command") ? Rf_mkChar(bson_iter_utf8(&iter, NULL)) : NA_STRING);
+    REAL(duration)[i] = bson_iter_init_find(&iter, docs[i], "duration") ? bson_iter_double(&iter) : NA_REAL;
+    REAL(ndocs)[i] = bson_iter_init_find(&iter, docs[i], "ndocs") ? bson_iter_int64(&iter) : NA_REAL;
+    SET_STRING_ELT(error, i, bson_iter_init_find(&iter, docs[i], "error") ? Rf_mkCharCE(bson_iter_utf8(&iter, NULL), CE_UTF8) : NA_STRING);
+    if(bson_iter_init_find(&iter, docs[i], "cmd") && BSON_ITER_HOLDS_DOCUMENT(&iter)){
+      uint32_t len;
+      const uint8_t *data;
+      bson_t sub;
+      bson_iter_document(&iter, &len, &data);
+      bson_init_static(&sub, data, len);
+      char *json = bson_as_relaxed_extended_json(&sub, NULL);
+      SET_STRING_ELT(cmd, i, Rf_mkCharCE(json, CE_UTF8));
+      bson_free(json);
+    } else {
+      SET_STRING_ELT(cmd, i, NA_STRING);
+    }
+    bson_destroy(docs[i]);
+  }
+  bson_free(docs);
+  SEXP out = PROTECT(Rf_allocVector(VECSXP, 7));
+  SET_VECTOR_ELT(out, 0, time);
+  SET_VECTOR_ELT(out, 1, ns);
+  SET_VECTOR_ELT(out, 2, command);
+  SET_VECTOR_ELT(out, 3, duration);
+  SET_VECTOR_ELT(out, 4, ndocs);
+  SET_VECTOR_ELT(out, 5, error);
+  SET_VECTOR_ELT(out, 6, cmd);
+  Rf_setAttrib(out, Rf_install("dropped"), Rf_ScalarReal(dropped));
+  UNPROTECT(8);
+  return out;
+}
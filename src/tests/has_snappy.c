@@ -0,0 +1,4 @@
+#include <snappy-c.h>
+int main () {
+  return snappy_max_compressed_length(1) > 0 ? 0 : 1;
+}
@@ -0,0 +1,4 @@
+#include <zstd.h>
+int main () {
+  return ZSTD_compressBound(1) > 0 ? 0 : 1;
+}
@@ -0,0 +1,1167 @@
+#include <mongolite.h>
+#include <common-thread-private.h>
+#include <mongoc/mongoc-collection-private.h>
+#include <mongoc/mongoc-util-private.h>
+#include <mongoc/mongoc-gridfs-file-private.h>
+#include <mongoc/uthash.h>
+
+/* Parallel GridFS transfers. Worker threads each pop their own client from a
+ * pool and claim batches of chunks from a shared counter. Workers must never
+ * call the R API: errors are stored in the job and raised after joining. */
+
+#define DEFAULT_CHUNK_SIZE (255 * 1024)
+#define BATCH_BYTES (8 * 1024 * 1024)
+
+#ifdef _WIN32
+#define fseek64 fseeko64
+#define ftell64 ftello64
+#else
+#define fseek64 fseeko
+#define ftell64 ftello
+#endif
+
+/* Chunks [0, total) are handed out to workers in batches */
+typedef struct {
+  bson_mutex_t lock;
+  int32_t next;
+  int32_t total;
+  int32_t batch;
+  bool failed;
+  bson_error_t err;
+} work_queue;
+
+typedef struct {
+  work_queue queue;
+  mongoc_client_pool_t *pool;
+  bool shared;
+  const char *db;
+  const char *chunks;
+  const char *path;
+  const mongoc_read_prefs_t *prefs;
+  bson_value_t files_id;
+  int64_t length;
+  int32_t chunk_size;
+  int codec;
+} transfer_job;
+
+/* Records the first error and makes other workers stop claiming work */
+static void queue_fail(work_queue *queue, const bson_error_t *err){
+  bson_mutex_lock(&queue->lock);
+  if(!queue->failed)
+    memcpy(&queue->err, err, sizeof(bson_error_t));
+  queue->failed = true;
+  bson_mutex_unlock(&queue->lock);
+}
+
+/* Claims the next range of chunks [first, last). Returns false when done. */
+static bool queue_claim(work_queue *queue, int32_t *first, int32_t *last){
+  bson_mutex_lock(&queue->lock);
+  *first = queue->next;
+  *last = BSON_MIN(queue->next + queue->batch, queue->total);
+  queue->next = *last;
+  bool more = !queue->failed && *first < *last;
+  bson_mutex_unlock(&queue->lock);
+  return more;
+}
+
+/* Clients from the pool of a pooled client are counted as in use by workers */
+static mongoc_client_t * job_pop(transfer_job *job){
+  return job->shared ? pool_pop(job->pool) : mongoc_client_pool_pop(job->pool);
+}
+
+static void job_push(transfer_job *job, mongoc_client_t *client){
+  if(job->shared)
+    pool_push(job->pool, client);
+  else
+    mongoc_client_pool_push(job->pool, client);
+}
+
+static BSON_THREAD_FUN(upload_worker, arg){
+  transfer_job *job = arg;
+  bson_error_t err;
+  FILE *fp = fopen(job->path, "rb");
+  if(!fp){
+    bson_set_error(&err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_INVALID_FILENAME, "Failed to open file %s", job->path);
+    queue_fail(&job->queue, &err);
+    BSON_THREAD_RETURN;
+  }
+  mongoc_client_t *client = job_pop(job);
+  mongoc_collection_t *col = mongoc_client_get_collection(client, job->db, job->chunks);
+  bson_t *opts = BCON_NEW("ordered", BCON_BOOL(false));
+  uint8_t *buf = bson_malloc(job->chunk_size);
+  int32_t first, last;
+  while(queue_claim(&job->queue, &first, &last)){
+    if(fseek64(fp, (int64_t) first * job->chunk_size, SEEK_SET)){
+      bson_set_error(&err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_CORRUPT, "Failed to seek in %s", job->path);
+      queue_fail(&job->queue, &err);
+      break;
+    }
+    bool ok = true;
+    mongoc_bulk_operation_t *bulk = mongoc_collection_create_bulk_operation_with_opts(col, opts);
+    for(int32_t n = first; n < last; n++){
+      size_t expected = BSON_MIN(job->chunk_size, job->length - (int64_t) n * job->chunk_size);
+      size_t len = fread(buf, 1, expected, fp);
+      if(len != expected){
+        bson_set_error(&err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_CORRUPT, "Failed to read chunk %d from %s", n, job->path);
+        queue_fail(&job->queue, &err);
+        ok = false;
+        break;
+      }
+      size_t zlen = len;
+      uint8_t *zbuf = job->codec ? chunk_compress(job->codec, buf, len, &zlen) : NULL;
+      if(job->codec && !zbuf){
+        bson_set_error(&err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_CORRUPT, "Failed to compress chunk %d", n);
+        queue_fail(&job->queue, &err);
+        ok = false;
+        break;
+      }
+      bson_t doc = BSON_INITIALIZER;
+      BSON_APPEND_VALUE(&doc, "files_id", &job->files_id);
+      BSON_APPEND_INT32(&doc, "n", n);
+      BSON_APPEND_BINARY(&doc, "data", BSON_SUBTYPE_BINARY, zbuf ? zbuf : buf, zlen);
+      mongoc_bulk_operation_insert(bulk, &doc);
+      bson_destroy(&doc);
+      bson_free(zbuf);
+    }
+    if(ok){
+      bson_t reply;
+      if(!mongoc_bulk_operation_execute(bulk, &reply, &err))
+        queue_fail(&job->queue, &err);
+      bson_destroy(&reply);
+    }
+    mongoc_bulk_operation_destroy(bulk);
+    if(!ok)
+      break;
+  }
+  bson_free(buf);
+  bson_destroy(opts);
+  mongoc_collection_destroy(col);
+  job_push(job, client);
+  fclose(fp);
+  BSON_THREAD_RETURN;
+}
+
+static int64_t file_length(const char *path){
+  FILE *fp = fopen(path, "rb");
+  if(!fp)
+    stopf("Failed to open file %s", path);
+  int64_t len = fseek64(fp, 0, SEEK_END) ? -1 : ftell64(fp);
+  fclose(fp);
+  if(len < 0)
+    stopf("Failed to get size of file %s", path);
+  return len;
+}
+
+static int get_codec(SEXP compression){
+  int codec = Rf_length(compression) ? codec_from_name(CHAR(STRING_ELT(compression, 0))) : CODEC_NONE;
+  if(codec < 0)
+    stopf("Unsupported compression: %s", CHAR(STRING_ELT(compression, 0)));
+  return codec;
+}
+
+/* Runs workers until the queue is exhausted. The job must start with a queue. */
+static void run_workers(BSON_THREAD_FUN_TYPE(fun), work_queue *queue, int workers){
+  bson_thread_t *threads = bson_malloc0(workers * sizeof(bson_thread_t));
+  int started = 0;
+  bson_mutex_init(&queue->lock);
+  for(int i = 0; i < workers; i++){
+    if(mcommon_thread_create(&threads[i], fun, queue) != 0)
+      break;
+    started++;
+  }
+  for(int i = 0; i < started; i++)
+    mcommon_thread_join(threads[i]);
+  bson_free(threads);
+  bson_mutex_destroy(&queue->lock);
+  if(!started && !queue->failed){
+    bson_set_error(&queue->err, MONGOC_ERROR_CLIENT, MONGOC_ERROR_CLIENT_NOT_READY, "Failed to start worker threads");
+    queue->failed = true;
+  }
+}
+
+static void init_job(transfer_job *job, mongoc_gridfs_t *fs, SEXP path, int32_t chunk_size, int64_t length){
+  mongoc_collection_t *chunks = mongoc_gridfs_get_chunks(fs);
+  job->db = chunks->db;
+  job->chunks = mongoc_collection_get_name(chunks);
+  job->path = CHAR(STRING_ELT(path, 0));
+  job->length = length;
+  job->chunk_size = chunk_size;
+  job->queue.total = (int32_t) ((length + chunk_size - 1) / chunk_size);
+  job->queue.batch = BSON_MAX(1, BATCH_BYTES / chunk_size);
+}
+
+/* Number of workers that are useful for a given job */
+static int job_workers(transfer_job *job, SEXP workers){
+  int n_batches = (job->queue.total + job->queue.batch - 1) / job->queue.batch;
+  return BSON_MIN(BSON_MAX(1, Rf_asInteger(workers)), n_batches);
+}
+
+/* Workers share the pool of a pooled client if it can supply a client for each of
+ * them, otherwise a temporary pool is created */
+static void run_job(transfer_job *job, SEXP ptr_client, BSON_THREAD_FUN_TYPE(fun), SEXP workers){
+  int n_workers = job_workers(job, workers);
+  if(n_workers < 1)
+    return;
+  mongoc_client_pool_t *shared = client_get_pool(ptr_client);
+  job->shared = shared && client_pool_available(ptr_client) >= n_workers;
+  if(job->shared){
+    job->pool = shared;
+  } else if(!(job->pool = client_pool_from_client(r2client(ptr_client), n_workers))){
+    stop("Failed to create client pool");
+  }
+  run_workers(fun, &job->queue, n_workers);
+  log_flush();
+  if(!job->shared)
+    mongoc_client_pool_destroy(job->pool);
+  job->pool = NULL;
+}
+
+/* Validates a chunk and writes it at its offset in the output file */
+static bool write_chunk(transfer_job *job, FILE *fp, const bson_t *doc, int32_t expected, uint8_t *scratch, bson_error_t *err){
+  bson_iter_t iter;
+  bson_subtype_t subtype;
+  uint32_t len;
+  const uint8_t *data = NULL;
+  int64_t n = -1;
+  if(bson_iter_init_find(&iter, doc, "n") && BSON_ITER_HOLDS_NUMBER(&iter))
+    n = bson_iter_as_int64(&iter);
+  if(n != expected){
+    bson_set_error(err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_CHUNK_MISSING, "Missing chunk number %d", expected);
+    return false;
+  }
+  if(bson_iter_init_find(&iter, doc, "data") && BSON_ITER_HOLDS_BINARY(&iter))
+    bson_iter_binary(&iter, &subtype, &len, &data);
+  if(data)
+    data = chunk_payload(job->codec, data, &len, scratch, job->chunk_size);
+  int64_t offset = n * job->chunk_size;
+  if(!data || len != BSON_MIN(job->chunk_size, job->length - offset)){
+    bson_set_error(err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_CORRUPT, "Chunk %d has unexpected size", expected);
+    return false;
+  }
+  if(fseek64(fp, offset, SEEK_SET) || fwrite(data, 1, len, fp) != len){
+    bson_set_error(err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_CORRUPT, "Failed to write to %s", job->path);
+    return false;
+  }
+  return true;
+}
+
+/* Each claimed range [first, last) is fetched with its own cursor */
+static BSON_THREAD_FUN(download_worker, arg){
+  transfer_job *job = arg;
+  bson_error_t err;
+  FILE *fp = fopen(job->path, "r+b");
+  if(!fp){
+    bson_set_error(&err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_INVALID_FILENAME, "Failed to open file %s", job->path);
+    queue_fail(&job->queue, &err);
+    BSON_THREAD_RETURN;
+  }
+  mongoc_client_t *client = job_pop(job);
+  mongoc_collection_t *col = mongoc_client_get_collection(client, job->db, job->chunks);
+  bson_t *opts = BCON_NEW("sort", "{", "n", BCON_INT32(1), "}",
+    "projection", "{", "_id", BCON_INT32(0), "n", BCON_INT32(1), "data", BCON_INT32(1), "}");
+  uint8_t *scratch = job->codec ? bson_malloc(job->chunk_size) : NULL;
+  int32_t first, last;
+  while(queue_claim(&job->queue, &first, &last)){
+    bson_t filter = BSON_INITIALIZER;
+    bson_t range;
+    BSON_APPEND_VALUE(&filter, "files_id", &job->files_id);
+    BSON_APPEND_DOCUMENT_BEGIN(&filter, "n", &range);
+    BSON_APPEND_INT32(&range, "$gte", first);
+    BSON_APPEND_INT32(&range, "$lt", last);
+    bson_append_document_end(&filter, &range);
+    mongoc_cursor_t *c = mongoc_collection_find_with_opts(col, &filter, opts, job->prefs);
+    bson_destroy(&filter);
+    const bson_t *doc;
+    int32_t n = first;
+    bool ok = true;
+    while(ok && mongoc_cursor_next(c, &doc)){
+      ok = write_chunk(job, fp, doc, n++, scratch, &err);
+    }
+    if(ok && mongoc_cursor_error(c, &err)){
+      ok = false;
+    } else if(ok && n < last){
+      bson_set_error(&err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_CHUNK_MISSING, "Missing chunk number %d", n);
+      ok = false;
+    }
+    mongoc_cursor_destroy(c);
+    if(!ok){
+      queue_fail(&job->queue, &err);
+      break;
+    }
+  }
+  bson_free(scratch);
+  bson_destroy(opts);
+  mongoc_collection_destroy(col);
+  job_push(job, client);
+  fclose(fp);
+  BSON_THREAD_RETURN;
+}
+
+SEXP R_mongo_gridfs_download_parallel(SEXP ptr_fs, SEXP name, SEXP path, SEXP workers){
+  mongoc_gridfs_t *fs = r2gridfs(ptr_fs);
+  mongoc_gridfs_file_t *file = find_single_file(ptr_fs, name);
+  int64_t length = mongoc_gridfs_file_get_length(file);
+  int32_t chunk_size = mongoc_gridfs_file_get_chunk_size(file);
+  int codec = file_codec(file);
+  if(length < 0 || chunk_size <= 0 || codec < 0){
+    mongoc_gridfs_file_destroy(file);
+    stop("Invalid length, chunkSize or compression in files document");
+  }
+
+  /* Preallocate the output file so workers can write at any offset */
+  FILE *fp = fopen(CHAR(STRING_ELT(path, 0)), "wb");
+  if(!fp){
+    mongoc_gridfs_file_destroy(file);
+    stopf("Failed to open file %s", CHAR(STRING_ELT(path, 0)));
+  }
+  bool ok = length == 0 || (fseek64(fp, length - 1, SEEK_SET) == 0 && fputc(0, fp) != EOF);
+  if(fclose(fp) || !ok){
+    remove(CHAR(STRING_ELT(path, 0)));
+    mongoc_gridfs_file_destroy(file);
+    stopf("Failed to allocate file %s", CHAR(STRING_ELT(path, 0)));
+  }
+
+  transfer_job job = {0};
+  init_job(&job, fs, path, chunk_size, length);
+  job.codec = codec;
+  job.prefs = mongoc_collection_get_read_prefs(mongoc_gridfs_get_chunks(fs));
+  bson_value_copy(file_content_id(file), &job.files_id);
+  run_job(&job, R_ExternalPtrProtected(ptr_fs), download_worker, workers);
+  bson_value_destroy(&job.files_id);
+  if(job.queue.failed){
+    remove(CHAR(STRING_ELT(path, 0)));
+    mongoc_gridfs_file_destroy(file);
+    stop(job.queue.err.message);
+  }
+  SEXP val = PROTECT(create_outlist(file));
+  mongoc_gridfs_file_destroy(file);
+  UNPROTECT(1);
+  return val;
+}
+
+SEXP R_mongo_gridfs_upload_parallel(SEXP ptr_fs, SEXP name, SEXP path, SEXP content_type,
+                                    SEXP meta_ptr, SEXP workers, SEXP chunk_size, SEXP compression){
+  mongoc_gridfs_t *fs = r2gridfs(ptr_fs);
+  mongoc_collection_t *chunks = mongoc_gridfs_get_chunks(fs);
+  mongoc_collection_t *files = mongoc_gridfs_get_files(fs);
+  bson_oid_t oid;
+  bson_oid_init(&oid, NULL);
+
+  int32_t size = Rf_length(chunk_size) ? Rf_asInteger(chunk_size) : DEFAULT_CHUNK_SIZE;
+  if(size <= 0 || size > 16 * 1024 * 1024 - 1024)
+    stop("Invalid chunk size");
+  transfer_job job = {0};
+  init_job(&job, fs, path, size, file_length(CHAR(STRING_ELT(path, 0))));
+  job.codec = get_codec(compression);
+  job.files_id.value_type = BSON_TYPE_OID;
+  bson_oid_copy(&oid, &job.files_id.value.v_oid);
+
+  run_job(&job, R_ExternalPtrProtected(ptr_fs), upload_worker, workers);
+
+  bson_error_t err;
+  bson_t *selector = BCON_NEW("files_id", BCON_OID(&oid));
+  if(job.queue.failed){
+    mongoc_collection_delete_many(chunks, selector, NULL, NULL, &err);
+    bson_destroy(selector);
+    stop(job.queue.err.message);
+  }
+  bson_destroy(selector);
+
+  /* The files document is written last, so readers never see a partial file */
+  bson_t doc = BSON_INITIALIZER;
+  BSON_APPEND_OID(&doc, "_id", &oid);
+  BSON_APPEND_INT64(&doc, "length", job.length);
+  BSON_APPEND_INT32(&doc, "chunkSize", job.chunk_size);
+  BSON_APPEND_DATE_TIME(&doc, "uploadDate", _mongoc_get_real_time_ms());
+  BSON_APPEND_UTF8(&doc, "filename", Rf_translateCharUTF8(STRING_ELT(name, 0)));
+  if(Rf_length(content_type) && STRING_ELT(content_type, 0) != NA_STRING)
+    BSON_APPEND_UTF8(&doc, "contentType", CHAR(STRING_ELT(content_type, 0)));
+  if(Rf_length(meta_ptr))
+    BSON_APPEND_DOCUMENT(&doc, "metadata", r2bson(meta_ptr));
+  if(job.codec)
+    BSON_APPEND_UTF8(&doc, "compression", codec_name(job.codec));
+  bool success = mongoc_collection_insert_one(files, &doc, NULL, NULL, &err);
+  bson_destroy(&doc);
+  if(!success)
+    stop(err.message);
+
+  bson_t *filter = BCON_NEW("_id", BCON_OID(&oid));
+  mongoc_gridfs_file_t *file = mongoc_gridfs_find_one_with_opts(fs, filter, NULL, &err);
+  bson_destroy(filter);
+  if(file == NULL)
+    stop(err.message);
+  SEXP val = PROTECT(create_outlist(file));
+  mongoc_gridfs_file_destroy(file);
+  UNPROTECT(1);
+  return val;
+}
+
+/* Batch transfers of many small files. All files documents are resolved with a
+ * single $in query and all chunks are streamed from a single cursor sorted by
+ * (files_id, n), which is served by the standard GridFS chunks index. */
+
+typedef struct {
+  mongoc_gridfs_file_t *file;
+  bson_t key;
+  int64_t length;
+  int32_t chunk_size;
+  int32_t next;
+  int codec;
+  const char *path;
+  FILE *fp;
+  bool created;
+  uint8_t *buf;
+  void *same;
+  UT_hash_handle by_name;
+  UT_hash_handle by_id;
+} batch_file;
+
+/* Hash key for a files_id of any bson type: the serialized {"": id} document */
+static void batch_key(bson_t *key, const bson_value_t *id){
+  bson_init(key);
+  BSON_APPEND_VALUE(key, "", id);
+}
+
+static void batch_free(batch_file *files, int n){
+  for(int i = 0; i < n; i++){
+    if(files[i].file)
+      mongoc_gridfs_file_destroy(files[i].file);
+    if(files[i].fp)
+      fclose(files[i].fp);
+    bson_destroy(&files[i].key);
+  }
+  bson_free(files);
+}
+
+/* Removes the output files that were written before a batch download failed */
+static void batch_discard(batch_file *files, int n){
+  for(int i = 0; i < n; i++){
+    if(files[i].fp)
+      fclose(files[i].fp);
+    files[i].fp = NULL;
+    if(files[i].created)
+      remove(files[i].path);
+  }
+}
+
+/* Copies a chunk into the output buffer or file of its owner */
+static bool batch_chunk(batch_file *f, const bson_t *doc, uint8_t *scratch, bson_error_t *err){
+  bson_iter_t iter;
+  bson_subtype_t subtype;
+  uint32_t len;
+  const uint8_t *data = NULL;
+  int64_t n = -1;
+  const char *name = mongoc_gridfs_file_get_filename(f->file);
+  if(bson_iter_init_find(&iter, doc, "n") && BSON_ITER_HOLDS_NUMBER(&iter))
+    n = bson_iter_as_int64(&iter);
+  if(n != f->next){
+    bson_set_error(err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_CHUNK_MISSING, "Missing chunk number %d of %s", f->next, name);
+    return false;
+  }
+  if(bson_iter_init_find(&iter, doc, "data") && BSON_ITER_HOLDS_BINARY(&iter))
+    bson_iter_binary(&iter, &subtype, &len, &data);
+  if(data)
+    data = chunk_payload(f->codec, data, &len, scratch, f->chunk_size);
+  int64_t offset = n * f->chunk_size;
+  if(!data || offset >= f->length || len != BSON_MIN(f->chunk_size, f->length - offset)){
+    bson_set_error(err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_CORRUPT, "Chunk %d of %s has unexpected size", f->next, name);
+    return false;
+  }
+  f->next++;
+  if(f->buf){
+    memcpy(f->buf + offset, data, len);
+    return true;
+  }
+  if(!f->fp && !(f->created = (f->fp = fopen(f->path, "wb")) != NULL)){
+    bson_set_error(err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_INVALID_FILENAME, "Failed to open file %s", f->path);
+    return false;
+  }
+  if(fwrite(data, 1, len, f->fp) != len){
+    bson_set_error(err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_CORRUPT, "Failed to write to %s", f->path);
+    return false;
+  }
+
+  /* Chunks arrive grouped per file so at most one output file is open */
+  if(offset + len == f->length){
+    int res = fclose(f->fp);
+    f->fp = NULL;
+    if(res){
+      bson_set_error(err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_CORRUPT, "Failed to write to %s", f->path);
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool batch_fetch_chunks(mongoc_gridfs_t *fs, batch_file *files, int n, bson_error_t *err){
+  batch_file *by_id = NULL;
+  bson_t filter = BSON_INITIALIZER;
+  bson_t in;
+  bson_array_builder_t *ids;
+  int32_t scratch_size = 0;
+  BSON_APPEND_DOCUMENT_BEGIN(&filter, "files_id", &in);
+  bson_append_array_builder_begin(&in, "$in", -1, &ids);
+  for(int i = 0; i < n; i++){
+    const bson_value_t *id = file_content_id(files[i].file);
+    if(files[i].codec)
+      scratch_size = BSON_MAX(scratch_size, files[i].chunk_size);
+    batch_file *prev = NULL;
+    bson_destroy(&files[i].key);
+    batch_key(&files[i].key, id);
+
+    /* Deduplicated files may share their chunks with other files in the batch */
+    HASH_FIND(by_id, by_id, bson_get_data(&files[i].key), files[i].key.len, prev);
+    if(prev){
+      files[i].same = prev->same;
+      prev->same = &files[i];
+      continue;
+    }
+    HASH_ADD_KEYPTR(by_id, by_id, bson_get_data(&files[i].key), files[i].key.len, &files[i]);
+    if(files[i].length > 0)
+      bson_array_builder_append_value(ids, id);
+  }
+  bson_append_array_builder_end(&in, ids);
+  bson_append_document_end(&filter, &in);
+  bson_t *opts = BCON_NEW("sort", "{", "files_id", BCON_INT32(1), "n", BCON_INT32(1), "}",
+    "projection", "{", "_id", BCON_INT32(0), "files_id", BCON_INT32(1), "n", BCON_INT32(1), "data", BCON_INT32(1), "}");
+  mongoc_cursor_t *c = mongoc_collection_find_with_opts(mongoc_gridfs_get_chunks(fs), &filter, opts, NULL);
+  bson_destroy(&filter);
+  bson_destroy(opts);
+
+  const bson_t *doc;
+  bson_iter_t iter;
+  batch_file *cur = NULL;
+  uint8_t *scratch = scratch_size ? bson_malloc(scratch_size) : NULL;
+  bool ok = true;
+  while(ok && mongoc_cursor_next(c, &doc)){
+    if(!bson_iter_init_find(&iter, doc, "files_id")){
+      bson_set_error(err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_CORRUPT, "Chunk without files_id");
+      ok = false;
+      break;
+    }
+    bson_t key;
+    batch_key(&key, bson_iter_value(&iter));
+    if(!cur || key.len != cur->key.len || memcmp(bson_get_data(&key), bson_get_data(&cur->key), key.len))
+      HASH_FIND(by_id, by_id, bson_get_data(&key), key.len, cur);
+    bson_destroy(&key);
+    if(!cur){
+      bson_set_error(err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_CORRUPT, "Chunk with unexpected files_id");
+      ok = false;
+      break;
+    }
+    for(batch_file *f = cur; ok && f; f = f->same)
+      ok = batch_chunk(f, doc, scratch, err);
+  }
+  bson_free(scratch);
+  if(ok && mongoc_cursor_error(c, err))
+    ok = false;
+  mongoc_cursor_destroy(c);
+  HASH_CLEAR(by_id, by_id);
+  for(int i = 0; ok && i < n; i++){
+    if((int64_t) files[i].next * files[i].chunk_size < files[i].length){
+      bson_set_error(err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_CHUNK_MISSING, "Missing chunk number %d of %s",
+                     files[i].next, mongoc_gridfs_file_get_filename(files[i].file));
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+/* Resolves unique filenames with one query, the first match of each name wins */
+static batch_file *batch_find_files(mongoc_gridfs_t *fs, SEXP names){
+  int n = Rf_length(names);
+  batch_file *files = bson_malloc0(n * sizeof(batch_file));
+  for(int i = 0; i < n; i++)
+    bson_init(&files[i].key);
+  batch_file *by_name = NULL;
+  bson_t filter = BSON_INITIALIZER;
+  bson_t in;
+  bson_array_builder_t *list;
+  BSON_APPEND_DOCUMENT_BEGIN(&filter, "filename", &in);
+  bson_append_array_builder_begin(&in, "$in", -1, &list);
+  for(int i = 0; i < n; i++){
+    const char *name = Rf_translateCharUTF8(STRING_ELT(names, i));
+    HASH_ADD_KEYPTR(by_name, by_name, name, strlen(name), &files[i]);
+    bson_array_builder_append_utf8(list, name, -1);
+  }
+  bson_append_array_builder_end(&in, list);
+  bson_append_document_end(&filter, &in);
+  mongoc_gridfs_file_list_t *res = mongoc_gridfs_find_with_opts(fs, &filter, NULL);
+  bson_destroy(&filter);
+  mongoc_gridfs_file_t *file;
+  while((file = mongoc_gridfs_file_list_next(res))){
+    const char *name = mongoc_gridfs_file_get_filename(file);
+    batch_file *f = NULL;
+    if(name)
+      HASH_FIND(by_name, by_name, name, strlen(name), f);
+    if(f && !f->file){
+      f->file = file;
+    } else {
+      mongoc_gridfs_file_destroy(file);
+    }
+  }
+  HASH_CLEAR(by_name, by_name);
+  bson_error_t err;
+  bool failed = mongoc_gridfs_file_list_error(res, &err);
+  mongoc_gridfs_file_list_destroy(res);
+  if(failed){
+    batch_free(files, n);
+    stop(err.message);
+  }
+  for(int i = 0; i < n; i++){
+    if(!files[i].file){
+      batch_free(files, n);
+      stopf("File not found: %s", CHAR(STRING_ELT(names, i)));
+    }
+    files[i].length = mongoc_gridfs_file_get_length(files[i].file);
+    files[i].chunk_size = mongoc_gridfs_file_get_chunk_size(files[i].file);
+    files[i].codec = file_codec(files[i].file);
+    if(files[i].length < 0 || files[i].chunk_size <= 0 || files[i].codec < 0){
+      batch_free(files, n);
+      stopf("Invalid length, chunkSize or compression in files document of %s", CHAR(STRING_ELT(names, i)));
+    }
+  }
+  return files;
+}
+
+/* Downloads many files at once. If paths is NULL the content is returned as raw vectors. */
+SEXP R_mongo_gridfs_download_batch(SEXP ptr_fs, SEXP names, SEXP paths){
+  mongoc_gridfs_t *fs = r2gridfs(ptr_fs);
+  int n = Rf_length(names);
+  batch_file *files = batch_find_files(fs, names);
+  SEXP data = PROTECT(Rf_allocVector(VECSXP, Rf_length(paths) ? 0 : n));
+  for(int i = 0; i < n; i++){
+    if(Rf_length(paths)){
+      files[i].path = CHAR(STRING_ELT(paths, i));
+    } else {
+      SET_VECTOR_ELT(data, i, Rf_allocVector(RAWSXP, files[i].length));
+      files[i].buf = RAW(VECTOR_ELT(data, i));
+    }
+  }
+  bson_error_t err;
+  if(!batch_fetch_chunks(fs, files, n, &err)){
+    batch_discard(files, n);
+    batch_free(files, n);
+    stop(err.message);
+  }
+
+  /* Empty files have no chunks */
+  for(int i = 0; i < n; i++){
+    if(files[i].path && files[i].length == 0){
+      FILE *fp = fopen(files[i].path, "wb");
+      files[i].created = fp != NULL;
+      if(!fp || fclose(fp)){
+        batch_discard(files, n);
+        batch_free(files, n);
+        stopf("Failed to open file %s", CHAR(STRING_ELT(paths, i)));
+      }
+    }
+  }
+  SEXP out = PROTECT(Rf_allocVector(VECSXP, n));
+  for(int i = 0; i < n; i++)
+    SET_VECTOR_ELT(out, i, create_outlist(files[i].file));
+  batch_free(files, n);
+  SEXP res = PROTECT(Rf_allocVector(VECSXP, 2));
+  SET_VECTOR_ELT(res, 0, out);
+  SET_VECTOR_ELT(res, 1, data);
+  UNPROTECT(3);
+  return res;
+}
+
+static bool batch_flush(mongoc_collection_t *col, mongoc_bulk_operation_t **bulk, const bson_t *opts, bson_error_t *err){
+  bson_t reply;
+  bool ok = mongoc_bulk_operation_execute(*bulk, &reply, err);
+  bson_destroy(&reply);
+  mongoc_bulk_operation_destroy(*bulk);
+  *bulk = mongoc_collection_create_bulk_operation_with_opts(col, opts);
+  return ok;
+}
+
+/* Reads input i, which is either a file path or a raw vector, and queues its chunks */
+static bool batch_add_chunks(SEXP data, int i, int32_t chunk_size, int codec, uint8_t *buf, const bson_oid_t *oid,
+                             mongoc_collection_t *col, mongoc_bulk_operation_t **bulk, const bson_t *opts,
+                             int64_t *pending, int64_t *length, bson_error_t *err){
+  FILE *fp = NULL;
+  const uint8_t *src = NULL;
+  int64_t size = 0;
+  if(Rf_isString(data)){
+    const char *path = CHAR(STRING_ELT(data, i));
+    if(!(fp = fopen(path, "rb"))){
+      bson_set_error(err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_INVALID_FILENAME, "Failed to open file %s", path);
+      return false;
+    }
+  } else {
+    src = RAW(VECTOR_ELT(data, i));
+    size = Rf_xlength(VECTOR_ELT(data, i));
+  }
+  bool ok = true;
+  *length = 0;
+  for(int32_t n = 0;; n++){
+    size_t len;
+    const uint8_t *chunk;
+    if(fp){
+      len = fread(buf, 1, chunk_size, fp);
+      chunk = buf;
+      if(len < chunk_size && ferror(fp)){
+        bson_set_error(err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_CORRUPT, "Failed to read from %s", CHAR(STRING_ELT(data, i)));
+        ok = false;
+        break;
+      }
+    } else {
+      len = BSON_MIN(chunk_size, size - *length);
+      chunk = src + *length;
+    }
+    if(len == 0)
+      break;
+    size_t zlen = len;
+    uint8_t *zbuf = codec ? chunk_compress(codec, chunk, len, &zlen) : NULL;
+    if(codec && !zbuf){
+      bson_set_error(err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_CORRUPT, "Failed to compress chunk %d", n);
+      ok = false;
+      break;
+    }
+    bson_t doc = BSON_INITIALIZER;
+    BSON_APPEND_OID(&doc, "files_id", oid);
+    BSON_APPEND_INT32(&doc, "n", n);
+    BSON_APPEND_BINARY(&doc, "data", BSON_SUBTYPE_BINARY, zbuf ? zbuf : chunk, zlen);
+    mongoc_bulk_operation_insert(*bulk, &doc);
+    bson_destroy(&doc);
+    bson_free(zbuf);
+    *length += len;
+    *pending += zlen;
+    if(*pending >= BATCH_BYTES){
+      *pending = 0;
+      if(!(ok = batch_flush(col, bulk, opts, err)))
+        break;
+    }
+    if(len < chunk_size)
+      break;
+  }
+  if(fp)
+    fclose(fp);
+  return ok;
+}
+
+/* Uploads many files at once, combining chunks of all files into large bulk inserts */
+SEXP R_mongo_gridfs_upload_batch(SEXP ptr_fs, SEXP names, SEXP data, SEXP content_type,
+                                 SEXP meta_ptr, SEXP chunk_size, SEXP compression){
+  mongoc_gridfs_t *fs = r2gridfs(ptr_fs);
+  mongoc_collection_t *chunks = mongoc_gridfs_get_chunks(fs);
+  mongoc_collection_t *files = mongoc_gridfs_get_files(fs);
+  int32_t size = Rf_length(chunk_size) ? Rf_asInteger(chunk_size) : DEFAULT_CHUNK_SIZE;
+  if(size <= 0 || size > 16 * 1024 * 1024 - 1024)
+    stop("Invalid chunk size");
+  int n = Rf_length(names);
+  int codec = get_codec(compression);
+  bson_t *opts = BCON_NEW("ordered", BCON_BOOL(false));
+  bson_oid_t *oids = bson_malloc0(n * sizeof(bson_oid_t));
+  bson_t **docs = bson_malloc0(n * sizeof(bson_t*));
+  uint8_t *buf = bson_malloc(size);
+  mongoc_bulk_operation_t *bulk = mongoc_collection_create_bulk_operation_with_opts(chunks, opts);
+  int64_t pending = 0;
+  int64_t upload_date = _mongoc_get_real_time_ms();
+  bson_error_t err;
+  bool ok = true;
+  for(int i = 0; ok && i < n; i++){
+    int64_t length;
+    bson_oid_init(&oids[i], NULL);
+    ok = batch_add_chunks(data, i, size, codec, buf, &oids[i], chunks, &bulk, opts, &pending, &length, &err);
+    docs[i] = bson_new();
+    BSON_APPEND_OID(docs[i], "_id", &oids[i]);
+    BSON_APPEND_INT64(docs[i], "length", length);
+    BSON_APPEND_INT32(docs[i], "chunkSize", size);
+    BSON_APPEND_DATE_TIME(docs[i], "uploadDate", upload_date);
+    BSON_APPEND_UTF8(docs[i], "filename", Rf_translateCharUTF8(STRING_ELT(names, i)));
+    if(Rf_length(content_type) && STRING_ELT(content_type, i) != NA_STRING)
+      BSON_APPEND_UTF8(docs[i], "contentType", CHAR(STRING_ELT(content_type, i)));
+    if(Rf_length(meta_ptr))
+      BSON_APPEND_DOCUMENT(docs[i], "metadata", r2bson(meta_ptr));
+    if(codec)
+      BSON_APPEND_UTF8(docs[i], "compression", codec_name(codec));
+  }
+  if(ok && pending)
+    ok = batch_flush(chunks, &bulk, opts, &err);
+
+  /* The files documents are written last, so readers never see a partial file */
+  if(ok){
+    mongoc_bulk_operation_t *insert = mongoc_collection_create_bulk_operation_with_opts(files, opts);
+    for(int i = 0; i < n; i++)
+      mongoc_bulk_operation_insert(insert, docs[i]);
+    bson_t reply;
+    ok = mongoc_bulk_operation_execute(insert, &reply, &err);
+    bson_destroy(&reply);
+    mongoc_bulk_operation_destroy(insert);
+  }
+  mongoc_bulk_operation_destroy(bulk);
+  bson_free(buf);
+  if(!ok){
+    bson_t selector = BSON_INITIALIZER;
+    bson_t in;
+    bson_array_builder_t *ids;
+    bson_error_t err2;
+    BSON_APPEND_DOCUMENT_BEGIN(&selector, "files_id", &in);
+    bson_append_array_builder_begin(&in, "$in", -1, &ids);
+    for(int i = 0; i < n && docs[i]; i++)
+      bson_array_builder_append_oid(ids, &oids[i]);
+    bson_append_array_builder_end(&in, ids);
+    bson_append_document_end(&selector, &in);
+    mongoc_collection_delete_many(chunks, &selector, NULL, NULL, &err2);
+    bson_destroy(&selector);
+  }
+  bson_destroy(opts);
+  bson_free(oids);
+  SEXP out = PROTECT(Rf_allocVector(VECSXP, ok ? n : 0));
+  for(int i = 0; i < n && docs[i]; i++){
+    if(ok){
+      mongoc_gridfs_file_t *file = _mongoc_gridfs_file_new_from_bson(fs, docs[i]);
+      SET_VECTOR_ELT(out, i, create_outlist(file));
+      mongoc_gridfs_file_destroy(file);
+    }
+    bson_destroy(docs[i]);
+  }
+  bson_free(docs);
+  if(!ok)
+    stop(err.message);
+  UNPROTECT(1);
+  return out;
+}
+
+/* Resumable transfers. An upload first inserts a files document without a
+ * filename, which records the source in a 'pending' field together with the
+ * number of chunks that were acknowledged. A download records its progress in
+ * a sidecar file next to the output. After a failure the same call picks up
+ * from the last checkpoint instead of starting over. */
+
+#define RESUME_SUFFIX ".resume"
+
+static bool resume_checkpoint(mongoc_collection_t *files, const bson_oid_t *oid, int32_t n, bson_error_t *err){
+  bson_t *selector = BCON_NEW("_id", BCON_OID(oid));
+  bson_t *update = BCON_NEW("$set", "{", "pending.n", BCON_INT32(n), "}");
+  bool ok = mongoc_collection_update_one(files, selector, update, NULL, NULL, err);
+  bson_destroy(selector);
+  bson_destroy(update);
+  return ok;
+}
+
+/* Removes the stubs and chunks of earlier attempts to upload the same path under the
+ * same name, which can no longer be resumed because the source has changed. */
+static void resume_purge(mongoc_collection_t *files, mongoc_collection_t *chunks, const bson_t *source){
+  bson_iter_t iter;
+  bson_error_t err;
+  bson_t *filter = bson_new();
+  if(bson_iter_init_find(&iter, source, "filename"))
+    BSON_APPEND_VALUE(filter, "pending.filename", bson_iter_value(&iter));
+  if(bson_iter_init_find(&iter, source, "path"))
+    BSON_APPEND_VALUE(filter, "pending.path", bson_iter_value(&iter));
+  bson_t *opts = BCON_NEW("projection", "{", "_id", BCON_INT32(1), "}");
+  mongoc_cursor_t *c = mongoc_collection_find_with_opts(files, filter, opts, NULL);
+  bson_destroy(opts);
+  bson_t ids = BSON_INITIALIZER;
+  const bson_t *doc;
+  uint32_t i = 0;
+  while(mongoc_cursor_next(c, &doc)){
+    if(bson_iter_init_find(&iter, doc, "_id")){
+      const char *key;
+      char buf[16];
+      bson_uint32_to_string(i++, &key, buf, sizeof buf);
+      BSON_APPEND_VALUE(&ids, key, bson_iter_value(&iter));
+    }
+  }
+  bool ok = !mongoc_cursor_error(c, &err);
+  mongoc_cursor_destroy(c);
+  if(ok && i > 0){
+    bson_t *stale_chunks = BCON_NEW("files_id", "{", "$in", BCON_ARRAY(&ids), "}");
+    bson_t *stale_files = BCON_NEW("_id", "{", "$in", BCON_ARRAY(&ids), "}");
+    ok = mongoc_collection_delete_many(chunks, stale_chunks, NULL, NULL, &err) &&
+      mongoc_collection_delete_many(files, stale_files, NULL, NULL, &err);
+    bson_destroy(stale_chunks);
+    bson_destroy(stale_files);
+  }
+  bson_destroy(&ids);
+  bson_destroy(filter);
+  if(!ok)
+    stop(err.message);
+}
+
+/* Finds the stub of an earlier attempt to upload the same source, or creates one */
+static int32_t resume_stub(mongoc_gridfs_t *fs, const bson_t *source, bson_oid_t *oid){
+  mongoc_collection_t *files = mongoc_gridfs_get_files(fs);
+  mongoc_collection_t *chunks = mongoc_gridfs_get_chunks(fs);
+  bson_t filter = BSON_INITIALIZER;
+  bson_iter_t iter;
+  bson_error_t err;
+  bson_iter_init(&iter, source);
+  while(bson_iter_next(&iter)){
+    char key[64];
+    bson_snprintf(key, sizeof key, "pending.%s", bson_iter_key(&iter));
+    BSON_APPEND_VALUE(&filter, key, bson_iter_value(&iter));
+  }
+  bson_t *opts = BCON_NEW("limit", BCON_INT64(1), "sort", "{", "pending.n", BCON_INT32(-1), "}");
+  mongoc_cursor_t *c = mongoc_collection_find_with_opts(files, &filter, opts, NULL);
+  bson_destroy(&filter);
+  bson_destroy(opts);
+  const bson_t *doc;
+  int32_t n = -1;
+  if(mongoc_cursor_next(c, &doc) && bson_iter_init_find(&iter, doc, "_id") && BSON_ITER_HOLDS_OID(&iter)){
+    bson_oid_copy(bson_iter_oid(&iter), oid);
+    n = bson_iter_init_find(&iter, doc, "pending.n") && BSON_ITER_HOLDS_NUMBER(&iter) ? bson_iter_as_int64(&iter) : 0;
+  }
+  bool failed = mongoc_cursor_error(c, &err);
+  mongoc_cursor_destroy(c);
+  if(failed)
+    stop(err.message);
+
+  if(n >= 0){
+    /* Chunks past the checkpoint may or may not have been written */
+    bson_t *stale = BCON_NEW("files_id", BCON_OID(oid), "n", "{", "$gte", BCON_INT32(n), "}");
+    bool ok = mongoc_collection_delete_many(chunks, stale, NULL, NULL, &err);
+    bson_destroy(stale);
+    if(!ok)
+      stop(err.message);
+    return n;
+  }
+  resume_purge(files, chunks, source);
+  bson_oid_init(oid, NULL);
+  bson_t stub = BSON_INITIALIZER;
+  bson_t pending;
+  BSON_APPEND_OID(&stub, "_id", oid);
+  BSON_APPEND_DOCUMENT_BEGIN(&stub, "pending", &pending);
+  bson_concat(&pending, source);
+  BSON_APPEND_INT32(&pending, "n", 0);
+  bson_append_document_end(&stub, &pending);
+  bool ok = mongoc_collection_insert_one(files, &stub, NULL, NULL, &err);
+  bson_destroy(&stub);
+  if(!ok)
+    stop(err.message);
+  return 0;
+}
+
+/* Uploads a file in ordered bulks of chunks, saving a checkpoint after each bulk */
+SEXP R_mongo_gridfs_upload_resume(SEXP ptr_fs, SEXP name, SEXP path, SEXP content_type,
+                                  SEXP meta_ptr, SEXP chunk_size, SEXP compression, SEXP mtime){
+  mongoc_gridfs_t *fs = r2gridfs(ptr_fs);
+  mongoc_collection_t *chunks = mongoc_gridfs_get_chunks(fs);
+  mongoc_collection_t *files = mongoc_gridfs_get_files(fs);
+  int32_t size = Rf_length(chunk_size) ? Rf_asInteger(chunk_size) : DEFAULT_CHUNK_SIZE;
+  if(size <= 0 || size > 16 * 1024 * 1024 - 1024)
+    stop("Invalid chunk size");
+  int codec = get_codec(compression);
+  const char *filename = CHAR(STRING_ELT(path, 0));
+  int64_t length = file_length(filename);
+
+  /* A stub only matches if the source file did not change in the meantime */
+  bson_t *source = BCON_NEW(
+    "filename", BCON_UTF8(Rf_translateCharUTF8(STRING_ELT(name, 0))),
+    "path", BCON_UTF8(filename),
+    "length", BCON_INT64(length),
+    "mtime", BCON_DOUBLE(Rf_asReal(mtime)),
+    "chunkSize", BCON_INT32(size),
+    "compression", BCON_UTF8(codec_name(codec))
+  );
+  bson_oid_t oid;
+  int32_t n = resume_stub(fs, source, &oid);
+  bson_destroy(source);
+
+  FILE *fp = fopen(filename, "rb");
+  if(!fp)
+    stopf("Failed to open file %s", filename);
+  bson_error_t err;
+  bool ok = fseek64(fp, (int64_t) n * size, SEEK_SET) == 0;
+  if(!ok)
+    bson_set_error(&err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_CORRUPT, "Failed to seek in %s", filename);
+  uint8_t *buf = bson_malloc(size);
+  mongoc_bulk_operation_t *bulk = mongoc_collection_create_bulk_operation_with_opts(chunks, NULL);
+  int64_t pending = 0;
+  int32_t acked = n;
+  while(ok){
+    size_t len = fread(buf, 1, size, fp);
+    if(len < size && ferror(fp)){
+      bson_set_error(&err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_CORRUPT, "Failed to read from %s", filename);
+      ok = false;
+      break;
+    }
+    if(len > 0){
+      size_t zlen = len;
+      uint8_t *zbuf = codec ? chunk_compress(codec, buf, len, &zlen) : NULL;
+      if(codec && !zbuf){
+        bson_set_error(&err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_CORRUPT, "Failed to compress chunk %d", n);
+        ok = false;
+        break;
+      }
+      bson_t doc = BSON_INITIALIZER;
+      BSON_APPEND_OID(&doc, "files_id", &oid);
+      BSON_APPEND_INT32(&doc, "n", n++);
+      BSON_APPEND_BINARY(&doc, "data", BSON_SUBTYPE_BINARY, zbuf ? zbuf : buf, zlen);
+      mongoc_bulk_operation_insert(bulk, &doc);
+      bson_destroy(&doc);
+      bson_free(zbuf);
+      pending += zlen;
+    }
+    bool eof = len < size;
+    if(pending && (eof || pending >= BATCH_BYTES)){
+      pending = 0;
+      ok = batch_flush(chunks, &bulk, NULL, &err) && resume_checkpoint(files, &oid, n, &err);
+      if(ok)
+        acked = n;
+    }
+    if(eof)
+      break;
+  }
+  fclose(fp);
+  bson_free(buf);
+  mongoc_bulk_operation_destroy(bulk);
+  if(!ok)
+    stopf("Upload of %s stopped after %d chunks, retry with resume = TRUE to continue. %s", filename, acked, err.message);
+
+  /* Replacing the stub removes the 'pending' field and makes the file visible */
+  bson_t doc = BSON_INITIALIZER;
+  BSON_APPEND_OID(&doc, "_id", &oid);
+  BSON_APPEND_INT64(&doc, "length", length);
+  BSON_APPEND_INT32(&doc, "chunkSize", size);
+  BSON_APPEND_DATE_TIME(&doc, "uploadDate", _mongoc_get_real_time_ms());
+  BSON_APPEND_UTF8(&doc, "filename", Rf_translateCharUTF8(STRING_ELT(name, 0)));
+  if(Rf_length(content_type) && STRING_ELT(content_type, 0) != NA_STRING)
+    BSON_APPEND_UTF8(&doc, "contentType", CHAR(STRING_ELT(content_type, 0)));
+  if(Rf_length(meta_ptr))
+    BSON_APPEND_DOCUMENT(&doc, "metadata", r2bson(meta_ptr));
+  if(codec)
+    BSON_APPEND_UTF8(&doc, "compression", codec_name(codec));
+  bson_t *selector = BCON_NEW("_id", BCON_OID(&oid));
+  ok = mongoc_collection_replace_one(files, selector, &doc, NULL, NULL, &err);
+  bson_destroy(selector);
+  if(!ok){
+    bson_destroy(&doc);
+    stop(err.message);
+  }
+  mongoc_gridfs_file_t *file = _mongoc_gridfs_file_new_from_bson(fs, &doc);
+  bson_destroy(&doc);
+  SEXP val = PROTECT(create_outlist(file));
+  mongoc_gridfs_file_destroy(file);
+  UNPROTECT(1);
+  return val;
+}
+
+/* The sidecar holds the identity of the file and the number of chunks on disk */
+static bool resume_save(const char *sidecar, const bson_t *key, int32_t n){
+  bson_t doc;
+  bson_copy_to(key, &doc);
+  BSON_APPEND_INT32(&doc, "n", n);
+  char *json = bson_as_canonical_extended_json(&doc, NULL);
+  bson_destroy(&doc);
+  FILE *fp = fopen(sidecar, "wb");
+  bool ok = fp && fputs(json, fp) >= 0;
+  if(fp && fclose(fp))
+    ok = false;
+  bson_free(json);
+  return ok;
+}
+
+/* Returns the checkpoint in the sidecar if it belongs to the same file */
+static int32_t resume_load(const char *sidecar, const bson_t *key){
+  FILE *fp = fopen(sidecar, "rb");
+  if(!fp)
+    return 0;
+  char json[4096];
+  size_t len = fread(json, 1, sizeof json - 1, fp);
+  fclose(fp);
+  json[len] = '\0';
+  bson_t *doc = bson_new_from_json((const uint8_t *) json, len, NULL);
+  if(!doc)
+    return 0;
+  bson_t id;
+  bson_iter_t iter;
+  bson_init(&id);
+  bson_copy_to_excluding_noinit(doc, &id, "n", NULL);
+  int32_t n = 0;
+  if(id.len == key->len && !memcmp(bson_get_data(&id), bson_get_data(key), key->len) &&
+     bson_iter_init_find(&iter, doc, "n") && BSON_ITER_HOLDS_INT32(&iter))
+    n = BSON_MAX(0, bson_iter_int32(&iter));
+  bson_destroy(&id);
+  bson_destroy(doc);
+  return n;
+}
+
+/* Downloads chunks in order, appending to a partial output from an earlier attempt */
+SEXP R_mongo_gridfs_download_resume(SEXP ptr_fs, SEXP name, SEXP path){
+  mongoc_gridfs_t *fs = r2gridfs(ptr_fs);
+  mongoc_gridfs_file_t *file = find_single_file(ptr_fs, name);
+  int64_t length = mongoc_gridfs_file_get_length(file);
+  int32_t chunk_size = mongoc_gridfs_file_get_chunk_size(file);
+  int codec = file_codec(file);
+  if(length < 0 || chunk_size <= 0 || codec < 0){
+    mongoc_gridfs_file_destroy(file);
+    stop("Invalid length, chunkSize or compression in files document");
+  }
+  transfer_job job = {0};
+  init_job(&job, fs, path, chunk_size, length);
+  job.codec = codec;
+
+  bson_t key = BSON_INITIALIZER;
+  BSON_APPEND_VALUE(&key, "files_id", file_content_id(file));
+  BSON_APPEND_INT64(&key, "length", length);
+  BSON_APPEND_INT32(&key, "chunkSize", chunk_size);
+  BSON_APPEND_DATE_TIME(&key, "uploadDate", mongoc_gridfs_file_get_upload_date(file));
+  char *sidecar = bson_strdup_printf("%s%s", job.path, RESUME_SUFFIX);
+  int32_t n = resume_load(sidecar, &key);
+  FILE *fp = n > 0 ? fopen(job.path, "r+b") : NULL;
+  if(!fp){
+    n = 0;
+    fp = fopen(job.path, "wb");
+  }
+  bson_error_t err;
+  bool ok = fp != NULL && resume_save(sidecar, &key, n);
+  if(!ok)
+    bson_set_error(&err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_INVALID_FILENAME, "Failed to open file %s", job.path);
+
+  bson_t *filter = bson_new();
+  BSON_APPEND_VALUE(filter, "files_id", file_content_id(file));
+  BCON_APPEND(filter, "n", "{", "$gte", BCON_INT32(n), "}");
+  bson_t *opts = BCON_NEW("sort", "{", "n", BCON_INT32(1), "}",
+    "projection", "{", "_id", BCON_INT32(0), "n", BCON_INT32(1), "data", BCON_INT32(1), "}");
+  mongoc_cursor_t *c = ok ? mongoc_collection_find_with_opts(mongoc_gridfs_get_chunks(fs), filter, opts, NULL) : NULL;
+  bson_destroy(filter);
+  bson_destroy(opts);
+  uint8_t *scratch = codec ? bson_malloc(chunk_size) : NULL;
+  const bson_t *doc;
+  int64_t pending = 0;
+  while(ok && mongoc_cursor_next(c, &doc)){
+    if(!(ok = write_chunk(&job, fp, doc, n, scratch, &err)))
+      break;
+    n++;
+    if((pending += chunk_size) >= BATCH_BYTES){
+      pending = 0;
+      ok = fflush(fp) == 0 && resume_save(sidecar, &key, n);
+      if(!ok)
+        bson_set_error(&err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_CORRUPT, "Failed to write to %s", job.path);
+    }
+  }
+  if(ok && mongoc_cursor_error(c, &err)){
+    ok = false;
+  } else if(ok && n < job.queue.total){
+    bson_set_error(&err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_CHUNK_MISSING, "Missing chunk number %d", n);
+    ok = false;
+  }
+  if(c)
+    mongoc_cursor_destroy(c);
+  bson_free(scratch);
+  if(fp && fclose(fp) && ok){
+    bson_set_error(&err, MONGOC_ERROR_GRIDFS, MONGOC_ERROR_GRIDFS_CORRUPT, "Failed to write to %s", job.path);
+    ok = false;
+  }
+
+  /* Record how far we got so that the next attempt can continue from there */
+  if(!ok && fp)
+    resume_save(sidecar, &key, n);
+  if(ok)
+    remove(sidecar);
+  bson_free(sidecar);
+  bson_destroy(&key);
+  if(!ok){
+    mongoc_gridfs_file_destroy(file);
+    stopf("Download stopped after %d chunks, retry with resume = TRUE to continue. %s", n, err.message);
+  }
+  SEXP val = PROTECT(create_outlist(file));
+  mongoc_gridfs_file_destroy(file);
+  UNPROTECT(1);
+  return val;
+}
@@ -52,30 +52,38 @@ bson_t* r2bson(SEXP ptr){
 }
 
 mongoc_collection_t* r2col(SEXP ptr){
+  log_flush();
   mongoc_collection_t * col = R_ExternalPtrAddr(ptr);
   if(!col)
     Rf_error("Collection has been destroyed.");
+  client_check_fork(ptr);
   return col;
 }
 
 mongoc_gridfs_t* r2gridfs(SEXP ptr){
+  log_flush();
   mongoc_gridfs_t* c = R_ExternalPtrAddr(ptr);
   if(!c)
     Rf_error("This grid has been destroyed.");
+  client_check_fork(ptr);
   return c;
 }
 
 mongoc_cursor_t* r2cursor(SEXP ptr){
+  log_flush();
   mongoc_cursor_t* c = R_ExternalPtrAddr(ptr);
   if(!c)
     Rf_error("Cursor has been destroyed.");
+  client_check_fork(ptr);
   return c;
 }
 
 mongoc_client_t* r2client(SEXP ptr){
+  log_flush();
   mongoc_client_t *client = R_ExternalPtrAddr(ptr);
   if(!client)
     Rf_error("Client has been destroyed.");
+  client_check_fork(ptr);
   return client;
 }
 
@@ -105,6 +113,7 @@ static void fin_cursor(SEXP ptr){
 #endif
 
   if(!R_ExternalPtrAddr(ptr)) return;
+  client_check_fork(ptr);
   mongoc_cursor_destroy(R_ExternalPtrAddr(ptr));
   R_SetExternalPtrProtected(ptr, R_NilValue);
   R_ClearExternalPtr(ptr);
@@ -116,6 +125,7 @@ static void fin_client(SEXP ptr){
 #endif
 
   if(!R_ExternalPtrAddr(ptr)) return;
+  client_check_fork(ptr);
   mongoc_client_destroy(R_ExternalPtrAddr(ptr));
   R_SetExternalPtrProtected(ptr, R_NilValue);
   R_ClearExternalPtr(ptr);
@@ -168,6 +178,7 @@ SEXP client2r(mongoc_client_t *client){
   SEXP ptr = PROTECT(R_MakeExternalPtr(client, R_NilValue, R_NilValue));
   R_RegisterCFinalizerEx(ptr, fin_client, 1);
   Rf_setAttrib(ptr, R_ClassSymbol, Rf_mkString("mongo_client"));
+  client_set_pid(ptr);
   UNPROTECT(1);
   return ptr;
 }
@@ -0,0 +1,145 @@
+#include <mongolite.h>
+#include <common-thread-private.h>
+
+/* Connection warm-up. Server selection makes the client discover the topology, which
+ * scans all hosts in parallel. A ping to every data bearing server then opens and
+ * authenticates a connection to each of them. For a pooled client, all clients are
+ * popped first, so that each of them is a distinct connection, then warmed up by a
+ * worker each at the same time, and only pushed back after all workers are done so
+ * that the connections are ready in the pool. */
+
+typedef struct {
+  int worker;
+  double rtt_ms;
+  double connect_ms;
+  char host[256];
+  char type[32];
+  char error[128];
+} warmup_record;
+
+typedef struct {
+  bson_mutex_t lock;
+  mongoc_client_t **clients;
+  warmup_record *records;
+  int n_records;
+  int cap;
+  int next_worker;
+} warmup_job;
+
+static void add_record(warmup_job *job, const warmup_record *rec){
+  bson_mutex_lock(&job->lock);
+  if(job->n_records == job->cap){
+    job->cap = BSON_MAX(16, 2 * job->cap);
+    job->records = bson_realloc(job->records, job->cap * sizeof(warmup_record));
+  }
+  job->records[job->n_records++] = *rec;
+  bson_mutex_unlock(&job->lock);
+}
+
+static bool skip_server(const char *type){
+  return !strcmp(type, "Unknown") || !strcmp(type, "RSArbiter") || !strcmp(type, "RSGhost") ||
+    !strcmp(type, "PossiblePrimary");
+}
+
+static void warmup_client(warmup_job *job, mongoc_client_t *client, int worker){
+  bson_error_t err;
+  warmup_record rec = {0};
+  rec.worker = worker;
+  mongoc_server_description_t *selected = mongoc_client_select_server(client, false, NULL, &err);
+  if(!selected){
+    rec.connect_ms = -1;
+    rec.rtt_ms = -1;
+    bson_strncpy(rec.error, err.message, sizeof rec.error);
+    add_record(job, &rec);
+    return;
+  }
+  mongoc_server_description_destroy(selected);
+  size_t n = 0;
+  bson_t *ping = BCON_NEW("ping", BCON_INT32(1));
+  mongoc_server_description_t **servers = mongoc_client_get_server_descriptions(client, &n);
+  for(size_t i = 0; i < n; i++){
+    const char *type = mongoc_server_description_type(servers[i]);
+    if(skip_server(type))
+      continue;
+    memset(&rec, 0, sizeof rec);
+    rec.worker = worker;
+    bson_strncpy(rec.host, mongoc_server_description_host(servers[i])->host_and_port, sizeof rec.host);
+    bson_strncpy(rec.type, type, sizeof rec.type);
+    rec.rtt_ms = mongoc_server_description_round_trip_time(servers[i]);
+    int64_t start = bson_get_monotonic_time();
+    bool ok = mongoc_client_command_simple_with_server_id(client, "admin", ping, NULL,
+      mongoc_server_description_id(servers[i]), NULL, &err);
+    rec.connect_ms = (bson_get_monotonic_time() - start) / 1000.0;
+    if(!ok)
+      bson_strncpy(rec.error, err.message, sizeof rec.error);
+    add_record(job, &rec);
+  }
+  mongoc_server_descriptions_destroy_all(servers, n);
+  bson_destroy(ping);
+}
+
+static BSON_THREAD_FUN(warmup_worker, arg){
+  warmup_job *job = arg;
+  bson_mutex_lock(&job->lock);
+  int worker = ++job->next_worker;
+  bson_mutex_unlock(&job->lock);
+  warmup_client(job, job->clients[worker - 1], worker);
+  BSON_THREAD_RETURN;
+}
+
+/* The client held by R is warmed up on the main thread, while workers warm up
+ * additional clients from the pool. The pool never grows beyond maxPoolSize. */
+SEXP R_mongo_client_warmup(SEXP ptr_client, SEXP connections){
+  mongoc_client_t *client = r2client(ptr_client);
+  warmup_job job = {0};
+  bson_mutex_init(&job.lock);
+  mongoc_client_pool_t *pool = client_get_pool(ptr_client);
+  int n_workers = pool ? BSON_MIN(Rf_asInteger(connections) - 1, client_pool_available(ptr_client)) : 0;
+  n_workers = BSON_MAX(n_workers, 0);
+  bson_thread_t *threads = bson_malloc0(BSON_MAX(n_workers, 1) * sizeof(bson_thread_t));
+  job.clients = bson_malloc0(BSON_MAX(n_workers, 1) * sizeof(mongoc_client_t*));
+  for(int i = 0; i < n_workers; i++)
+    job.clients[i] = pool_pop(pool);
+  int started = 0;
+  for(int i = 0; i < n_workers; i++){
+    if(mcommon_thread_create(&threads[i], warmup_worker, &job) != 0)
+      break;
+    started++;
+  }
+  warmup_client(&job, client, 0);
+  for(int i = 0; i < started; i++)
+    mcommon_thread_join(threads[i]);
+  for(int i = 0; i < n_workers; i++)
+    pool_push(pool, job.clients[i]);
+  log_flush();
+  bson_free(job.clients);
+  bson_free(threads);
+  bson_mutex_destroy(&job.lock);
+
+  int n = job.n_records;
+  SEXP host = PROTECT(Rf_allocVector(STRSXP, n));
+  SEXP type = PROTECT(Rf_allocVector(STRSXP, n));
+  SEXP connection = PROTECT(Rf_allocVector(INTSXP, n));
+  SEXP rtt = PROTECT(Rf_allocVector(REALSXP, n));
+  SEXP connect = PROTECT(Rf_allocVector(REALSXP, n));
+  SEXP error = PROTECT(Rf_allocVector(STRSXP, n));
+  for(int i = 0; i < n; i++){
+    warmup_record *rec = &job.records[i];
+    SET_STRING_ELT(host, i, rec->host[0] ? Rf_mkChar(rec->host) : NA_STRING);
+    SET_STRING_ELT(type, i, rec->type[0] ? Rf_mkChar(rec->type) : NA_STRING);
+    INTEGER(connection)[i] = rec->worker + 1;
+    REAL(rtt)[i] = rec->rtt_ms < 0 ? NA_REAL : rec->rtt_ms;
+    REAL(connect)[i] = rec->connect_ms < 0 ? NA_REAL : rec->connect_ms;
+    SET_STRING_ELT(error, i, rec->error[0] ? Rf_mkChar(rec->error) : NA_STRING);
+  }
+  bson_free(job.records);
+  SEXP out = PROTECT(Rf_allocVector(VECSXP, 6));
+  SET_VECTOR_ELT(out, 0, host);
+  SET_VECTOR_ELT(out, 1, type);
+  SET_VECTOR_ELT(out, 2, connection);
+  SET_VECTOR_ELT(out, 3, rtt);
+  SET_VECTOR_ELT(out, 4, connect);
+  SET_VECTOR_ELT(out, 5, error);
+  UNPROTECT(7);
+  return out;
+}